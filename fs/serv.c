@@ -46,8 +46,10 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Virtual address at which to receive page mappings containing client
+// requests, and how many bytes of the request were mapped there.
+union Fsipc *fsreq = (union Fsipc *)(0x10000000 - FSIPC_SIZE);
+static size_t fsreq_size;
 
 void
 serve_init(void)
@@ -232,7 +234,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
 
 	// Look up the file id, read the bytes into 'ret', and update
-	// the seek position.  Be careful if req->req_n > PGSIZE
+	// the seek position.  Be careful if req->req_n > fsreq_size
 	// (remember that read is always allowed to return fewer bytes
 	// than requested).  Also, be careful because ipc is a union,
 	// so filling in ret will overwrite req.
@@ -245,7 +247,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 		return r;
 
 	if ((r = file_read(o->o_file, ret->ret_buf,
-			   MIN(req->req_n, sizeof ret->ret_buf),
+			   MIN(req->req_n, fsreq_size),
 			   o->o_fd->fd_offset)) < 0)
 		return r;
 
@@ -272,7 +274,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 
-	if (req->req_n > sizeof(req->req_buf))
+	if (req->req_n > fsreq_size - offsetof(struct Fsreq_write, req_buf))
 		return -E_INVAL;
 
 	if ((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0)
@@ -371,13 +373,27 @@ fshandler handlers[] = {
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
+	uint32_t req, whom, client;
+	int perm, r, i;
 	void *pg;
 
+	// Reads and writes come with up to FSIPC_NPAGES pages.
+	if ((r = sys_ipc_set_maxpages(FSIPC_NPAGES)) < 0)
+		panic("sys_ipc_set_maxpages: %e", r);
+
+	// Each reply goes out in the same system call that waits for the
+	// next request (client 0 means there is no reply to send).
+	client = 0;
+	r = 0;
+	pg = NULL;
+	perm = 0;
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_reply_wait(client, r, pg, perm,
+				     (int32_t *) &whom, fsreq, &perm);
+		if (debug && client)
+			cprintf("FS: Sent response %d to %x\n", r, client);
+		client = 0;
+		fsreq_size = thisenv->env_ipc_npages * PGSIZE;
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -398,10 +414,9 @@ serve(void)
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		if(debug)
-			cprintf("FS: Sent response %d to %x\n", r, whom);
-		sys_page_unmap(0, fsreq);
+		client = whom;
+		for (i = 0; i < thisenv->env_ipc_npages; i++)
+			sys_page_unmap(0, (char *) fsreq + i * PGSIZE);
 	}
 }
 
@@ -43,6 +43,37 @@ enum {
 	ENV_NOT_RUNNABLE
 };
 
+// Values of env_sleep in struct Env
+enum {
+	ENV_SLEEP_NONE = 0,
+	ENV_SLEEP_UNTIL,	// In sys_sleep_until
+	ENV_SLEEP_FUTEX,	// In sys_futex_wait
+	ENV_SLEEP_CHILD,	// In sys_env_wait
+};
+
+// Exit status of an environment that was destroyed without exiting
+#define ENV_EXIT_KILLED		(-1)
+
+// An IPC message can grant a contiguous range of up to IPC_MAXPAGES
+// pages starting at srcva; the sender or's IPC_NPAGES(n) into perm to
+// send n of them.  The receiver maps at most env_ipc_maxpages pages at
+// dstva (see sys_ipc_set_maxpages) and drops the rest.
+#define IPC_MAXPAGES		16
+#define IPC_NPAGES_SHIFT	16
+#define IPC_NPAGES(n)		((n) << IPC_NPAGES_SHIFT)
+#define IPC_PERM_NPAGES(perm)	MAX((perm) >> IPC_NPAGES_SHIFT, 1)
+#define IPC_PERM_MASK		(IPC_NPAGES(1) - 1)
+
+// A demand-zero region reserved with sys_region_reserve.  The first
+// touch of each page in [er_start, er_end) maps a zeroed page there
+// with er_perm.  An unused slot has er_start == er_end.
+#define ENV_NREGION		32
+struct EnvRegion {
+	uintptr_t er_start;
+	uintptr_t er_end;
+	int er_perm;
+};
+
 // Special environment types
 enum EnvType {
 	ENV_TYPE_USER = 0,
@@ -64,6 +95,7 @@ struct Env {
 	enum EnvType env_type;		// Indicates special system environments
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint32_t env_syscalls;		// Number of system calls it has made
 #line 70 "../inc/env.h"
 	int env_cpunum;			// The CPU that the env is running on
 #line 72 "../inc/env.h"
@@ -72,17 +104,33 @@ struct Env {
 	pml4e_t *env_pml4e;		// Kernel virtual address of top-level page dir,
 	// or root of extended page tables in guest mode.
 	physaddr_t env_cr3;
+	int env_pcid;			// Process-context identifier (kern/pmap.c)
 #line 78 "../inc/env.h"
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
 
+	// System call ring
+	struct SysRing *env_ring;	// Registered with sys_ring_setup, or 0
+
+	// Demand-zero memory
+	struct EnvRegion env_regions[ENV_NREGION];
+
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
 	void *env_ipc_dstva;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_expect;		// Only sender accepted, 0 for any
+	int env_ipc_npages;		// Pages mapped at env_ipc_dstva
+	int env_ipc_maxpages;		// Most pages accepted per message
+	uint8_t env_sleep;		// Kernel wait it's blocked in: ENV_SLEEP_*
+
+	// Exit status
+	int env_exit_status;		// Passed to sys_env_exit
+	envid_t env_wait_for;		// Child it's blocked in sys_env_wait on
+	int env_child_status;		// Exit status sys_env_wait collected
 #line 90 "../inc/env.h"
 	uint8_t *elf;
 #line 93 "../inc/env.h"
@@ -37,6 +37,8 @@ enum {
 	E_VMX_ON = 19,    // Couldn't transition the cpu to VMX root mode
 	E_VMCS_INIT = 20, // Couldn't init the VMCS region
 	E_NO_ENT = 21,
+	E_AGAIN		= 22,	// Futex value changed or wait cut short; try again
+	E_TIMEOUT	= 23,	// Wait timed out
 	MAXERROR
 };
 
@@ -76,6 +76,12 @@ enum {
 #line 80 "../inc/fs.h"
 };
 
+// An Fsipc spans FSIPC_NPAGES pages so that one read or write can
+// move up to about 64KB.  Other requests only send the first page, and
+// reads and writes only send as many pages as their data needs.
+#define FSIPC_NPAGES	16		// At most IPC_MAXPAGES
+#define FSIPC_SIZE	(FSIPC_NPAGES * PGSIZE)
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -90,12 +96,12 @@ union Fsipc {
 		size_t req_n;
 	} read;
 	struct Fsret_read {
-		char ret_buf[PGSIZE];
+		char ret_buf[FSIPC_SIZE];
 	} readRet;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
-		char req_buf[PGSIZE - (sizeof(int) + sizeof(size_t))];
+		char req_buf[FSIPC_SIZE - (sizeof(int) + sizeof(size_t))];
 	} write;
 	struct Fsreq_stat {
 		int req_fileid;
@@ -113,8 +119,8 @@ union Fsipc {
 	} remove;
 #line 129 "../inc/fs.h"
 
-	// Ensure Fsipc is one page
-	char _pad[PGSIZE];
+	// Ensure Fsipc is FSIPC_NPAGES pages
+	char _pad[FSIPC_SIZE];
 };
 
 #endif /* !JOS_INC_FS_H */
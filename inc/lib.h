@@ -43,6 +43,7 @@ extern const volatile struct PageInfo pages[];
 
 // exit.c
 void	exit(void);
+void	exit_with(int status);
 
 #line 51 "../inc/lib.h"
 // pgfault.c
@@ -60,6 +61,7 @@ int	sys_env_destroy(envid_t);
 #line 64 "../inc/lib.h"
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
 int	sys_env_set_status(envid_t env, int status);
 #line 68 "../inc/lib.h"
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
@@ -69,10 +71,25 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(struct PageOp *ops, int n);
 int	sys_ipc_try_send(envid_t to_env, uint64_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint64_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint64_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_set_maxpages(int npages);
+int	sys_ring_setup(struct SysRing *ring);
+int	sys_ring_enter(void);
+int	sys_region_reserve(void *va, size_t len, int perm);
 #line 78 "../inc/lib.h"
 unsigned int sys_time_msec(void);
+int	sys_sleep_until(unsigned int msec);
+uint64_t sys_time_ns(void);
+int	sys_futex_wait(const volatile uint32_t *va, uint32_t val, unsigned int timeout);
+int	sys_futex_wake(const volatile uint32_t *va, int n);
+void	sys_env_exit(int status);
+int	sys_env_wait(envid_t envid, int *status);
 #line 80 "../inc/lib.h"
 int	sys_net_transmit(const char *data, unsigned int len);
 int	sys_net_receive(char *buf, unsigned int len);
@@ -100,9 +117,28 @@ sys_exofork(void)
 	return ret;
 }
 
+// pagebatch.c
+struct PageBatch {
+	int n;
+	struct PageOp ops[PAGEOP_MAX];
+};
+int	pagebatch_add(struct PageBatch *b, int op, envid_t srcenv, void *srcva,
+		      envid_t dstenv, void *dstva, int perm);
+int	pagebatch_flush(struct PageBatch *b);
+
+// ring.c
+int	ring_submit(uint64_t data, int syscallno, uint64_t a1, uint64_t a2,
+		    uint64_t a3, uint64_t a4, uint64_t a5);
+int	ring_enter(void);
+bool	ring_reap(struct RingCqe *cqe);
+
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 #line 114 "../inc/lib.h"
@@ -113,7 +149,6 @@ int32_t ipc_host_recv(void *pg);
 #line 119 "../inc/lib.h"
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 #line 125 "../inc/lib.h"
@@ -182,6 +217,61 @@ int	pipeisclosed(int pipefd);
 
 // wait.c
 void	wait(envid_t env);
+
+// time.c
+unsigned int time_msec(void);
+uint64_t time_ns(void);
+
+// sync.c
+// These block with sys_futex_wait.  To synchronize several
+// environments, put them in a PTE_SHARE page.
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 held, 2 held with waiters
+};
+struct Cond {
+	volatile uint32_t c_seq;	// Bumped by every signal
+};
+struct Sem {
+	volatile uint32_t s_count;
+	volatile uint32_t s_waiters;
+};
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+void	cond_init(struct Cond *c);
+void	cond_wait(struct Cond *c, struct Mutex *m);
+int	cond_timedwait(struct Cond *c, struct Mutex *m, unsigned int msec);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+void	sem_init(struct Sem *s, uint32_t count);
+void	sem_wait(struct Sem *s);
+int	sem_timedwait(struct Sem *s, unsigned int msec);
+void	sem_post(struct Sem *s);
+
+// chan.c
+// A one-way ring of fixed-size slots between a producer and a consumer
+// environment, in PTE_SHARE pages that both map at the same address.
+struct ChanRing {
+	volatile uint32_t cr_head;	// Next slot the consumer reads
+	volatile uint32_t cr_tail;	// Next slot the producer fills
+	volatile uint32_t cr_waiting;	// Consumer wants a doorbell
+	uint32_t cr_nslots;		// A power of two
+	uint32_t cr_slotsize;
+};
+struct Chan {
+	struct ChanRing *ch_ring;
+	envid_t ch_peer;		// Consumer, rung by the producer
+	uint32_t ch_doorbell;		// IPC value of the doorbell
+};
+int	chan_create(struct Chan *c, void *va, uint32_t nslots,
+		    uint32_t slotsize);
+void	chan_attach(struct Chan *c, envid_t peer, uint32_t doorbell);
+void	*chan_write_slot(struct Chan *c);
+void	chan_write_commit(struct Chan *c);
+void	*chan_read_slot(struct Chan *c);
+void	chan_read_done(struct Chan *c);
+bool	chan_arm(struct Chan *c);
+void	chan_wait(struct Chan *c);
 #line 191 "../inc/lib.h"
 
 /* File open modes */
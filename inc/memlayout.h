@@ -16,8 +16,8 @@
 // Global descriptor numbers
 #define GD_KT     0x08     // kernel text
 #define GD_KD     0x10     // kernel data
-#define GD_UT     0x18     // user text
-#define GD_UD     0x20     // user data
+#define GD_UD     0x18     // user data
+#define GD_UT     0x20     // user text (SYSRET needs it right after GD_UD)
 #define GD_TSS0   0x28     // Task segment selector for CPU 0
 
 /*
@@ -50,6 +50,7 @@
  * ULIM, MMIOBASE -->  +------------------------------+ 0x8003c00000
  *                     |  PageInfo structs (User R-)  | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0x8000a00000
+ *                     |  RO time page at top (UTIME) |
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0x8000800000
  *                     .                              .
@@ -119,6 +120,9 @@
 #define UPAGES		(ULIM - 25 * PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// Read-only copy of the kernel's clock (struct TimePage), in the last
+// page of the UENVS region
+#define UTIME		(UENVS + PTSIZE - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -201,6 +205,29 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 	
 	uint16_t pp_ref;
+
+	// PP_* flags below.
+	uint16_t pp_flags;
+
+	// If this page is an environment's PML4, its PCID (kern/pmap.c).
+	uint16_t pp_pcid;
+};
+
+#define PP_FREE		0x1	// on the free list
+#define PP_LARGE	0x2	// head of a 2MB page (see page_alloc_large)
+
+/*
+ * The kernel's clock, mapped read-only at UTIME so that user programs
+ * can read the time without a system call.  The kernel makes tp_seq
+ * odd while it updates the other fields; readers retry if tp_seq was
+ * odd or changed while they read.
+ */
+struct TimePage {
+	volatile uint32_t tp_seq;
+	uint32_t tp_hz;			// Timer ticks per second
+	volatile uint64_t tp_ticks;	// Timer ticks since boot
+	volatile uint64_t tp_tsc_hz;	// TSC counts per second; 0 if unknown
+	volatile uint64_t tp_tsc_base;	// TSC value at time 0
 };
 
 #line 207 "../inc/memlayout.h"
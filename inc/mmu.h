@@ -61,6 +61,7 @@
 
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
 #define PTSHIFT		21		// log2(PTSIZE)
+#define PDPESIZE	(PTSIZE*NPDENTRIES) // bytes mapped by a page directory pointer entry
 
 #define PTXSHIFT	12		// offset of PTX in a linear address
 #define PDXSHIFT	21		// offset of PDX in a linear address
@@ -82,6 +83,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Two of the PTE_AVAIL bits have a fixed meaning that sys_fork honors.
+#define PTE_SHARE	0x400	// Shared, not copied, across fork and spawn
+#define PTE_COW		0x800	// Copy-on-write
+
 // Flags in PTE_SYSCALL may be used only in system calls. (Others may not.)
 #define PTE_SYSCALL (PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -112,12 +117,28 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 #define CR4_VMXE	0x00002000	// VMX 
+#define CR4_PGE		0x00000080	// Page Global Enable
+#define CR4_PCIDE	0x00020000	// Process-Context Identifiers Enable
+
+// Bit 63 of a value written to CR3 keeps the new PCID's TLB entries
+#define CR3_NOFLUSH	(1ULL << 63)
+
+// INVPCID types
+#define INVPCID_ADDR	0	// One address in one PCID
+#define INVPCID_ALL	2	// All PCIDs, including global entries
 
 // x86_64 related flags
 #define CR4_PAE		0x00000020
 #define EFER_MSR	0xC0000080
+#define EFER_SCE	0	// bit: SYSCALL/SYSRET enable
 #define EFER_LME	8
 
+// SYSCALL/SYSRET configuration MSRs
+#define STAR_MSR	0xC0000081	// kernel and user segment bases
+#define LSTAR_MSR	0xC0000082	// 64-bit SYSCALL entry point
+#define SFMASK_MSR	0xC0000084	// RFLAGS bits cleared by SYSCALL
+#define KERNEL_GS_BASE_MSR	0xC0000102	// swapped in by SWAPGS
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -28,7 +28,8 @@ enum {
 	NSREQ_SEND,
 	NSREQ_SOCKET,
 
-	// The following two messages pass a page containing a struct jif_pkt
+	// The following two messages pass no page.  They are doorbells
+	// for the packet channels, whose slots hold a struct jif_pkt.
 	NSREQ_INPUT,
 	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
 	// network server, to the output environment
@@ -38,6 +39,11 @@ enum {
 	NSREQ_TIMER,
 };
 
+// An Nsipc spans NSIPC_NPAGES pages so that one send or recv can move
+// up to about 64KB.  Other requests only send the first page.
+#define NSIPC_NPAGES	16		// At most IPC_MAXPAGES
+#define NSIPC_SIZE	(NSIPC_NPAGES * PGSIZE)
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -99,8 +105,8 @@ union Nsipc {
 
 	struct jif_pkt pkt;
 
-	// Ensure Nsipc is one page
-	char _pad[PGSIZE];
+	// Ensure Nsipc is NSIPC_NPAGES pages
+	char _pad[NSIPC_SIZE];
 };
 
 #endif // !JOS_INC_NS_H
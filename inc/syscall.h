@@ -13,6 +13,7 @@ enum {
 	SYS_page_map,
 	SYS_page_unmap,
 	SYS_exofork,
+	SYS_fork,
 	SYS_env_set_status,
 #line 18 "../inc/syscall.h"
 	SYS_env_set_trapframe,
@@ -23,6 +24,19 @@ enum {
 	SYS_ipc_recv,
 #line 26 "../inc/syscall.h"
 	SYS_time_msec,
+	SYS_page_batch,
+	SYS_sleep_until,
+	SYS_time_ns,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_env_exit,
+	SYS_env_wait,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_ipc_set_maxpages,
+	SYS_ring_setup,
+	SYS_ring_enter,
+	SYS_region_reserve,
 #line 28 "../inc/syscall.h"
 	SYS_net_transmit,
 	SYS_net_receive,
@@ -39,4 +53,60 @@ enum {
 	NSYSCALLS
 };
 
+#ifndef __ASSEMBLER__
+
+#include <inc/types.h>
+
+// Operations for sys_page_batch.  Each one does the work of the system
+// call it is named after.
+enum {
+	PAGEOP_ALLOC = 0,	// sys_page_alloc(dstenv, dstva, perm)
+	PAGEOP_MAP,		// sys_page_map(srcenv, srcva, dstenv, dstva, perm)
+	PAGEOP_UNMAP,		// sys_page_unmap(dstenv, dstva)
+	PAGEOP_EPT_MAP,		// sys_ept_map(srcenv, srcva, dstenv, dstva, perm)
+};
+
+// Maximum number of entries in one sys_page_batch call.
+#define PAGEOP_MAX	64
+
+struct PageOp {
+	int op;			// PAGEOP_*
+	int32_t srcenv;
+	void *srcva;
+	int32_t dstenv;
+	void *dstva;		// guest physical address for PAGEOP_EPT_MAP
+	int perm;
+	int status;		// Set by the kernel: 0 or -E_*
+};
+
+// A system call ring: one page of user memory holding a queue of
+// system calls to run and a queue of their results (see
+// sys_ring_setup).  The environment fills sr_sq and advances
+// sr_sq_tail; on its next system call the kernel runs the calls,
+// posts each return value to sr_cq and advances sr_cq_tail.
+#define RING_NSQE	32
+#define RING_NCQE	64
+
+struct RingSqe {
+	uint64_t sqe_data;	// Passed through to the completion
+	uint64_t sqe_syscallno;	// SYS_*
+	uint64_t sqe_args[5];
+};
+
+struct RingCqe {
+	uint64_t cqe_data;
+	int64_t cqe_res;	// The system call's return value
+};
+
+struct SysRing {
+	volatile uint32_t sr_sq_head;	// Advanced by the kernel
+	volatile uint32_t sr_sq_tail;	// Advanced by the environment
+	volatile uint32_t sr_cq_head;	// Advanced by the environment
+	volatile uint32_t sr_cq_tail;	// Advanced by the kernel
+	struct RingSqe sr_sq[RING_NSQE];
+	struct RingCqe sr_cq[RING_NCQE];
+};
+
+#endif /* !__ASSEMBLER__ */
+
 #endif /* !JOS_INC_SYSCALL_H */
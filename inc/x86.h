@@ -37,6 +37,7 @@ static __inline uint64_t read_rbp(void) __attribute__((always_inline));
 static __inline uint64_t read_rsp(void) __attribute__((always_inline));
 static __inline void cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp);
 static __inline uint64_t read_tsc(void) __attribute__((always_inline));
+static __inline uint64_t bsf(uint64_t word) __attribute__((always_inline));
 static __inline uint64_t read_msr(uint32_t ecx) __attribute__((always_inline));
 static __inline void write_msr( uint32_t ecx, uint64_t val ) __attribute__((always_inline));
 static __inline void read_idtr (uint64_t *idtbase, uint16_t *idtlimit) __attribute__((always_inline));
@@ -223,6 +224,13 @@ rcr4(void)
 	return cr4;
 }
 
+static __inline void
+invpcid(uint64_t type, uint64_t pcid, uint64_t addr)
+{
+	struct { uint64_t pcid, addr; } desc = { pcid, addr };
+	__asm __volatile("invpcid %0,%1" : : "m" (desc), "r" (type) : "memory");
+}
+
 static __inline void
 tlbflush(void)
 {
@@ -267,9 +275,10 @@ static __inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
 	uint32_t eax, ebx, ecx, edx;
+	// Subleaf 0 for the leaves (like 7) that take one in %ecx.
 	asm volatile("cpuid" 
 			 : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-			 : "a" (info));
+			 : "a" (info), "c" (0));
 	if (eaxp)
 		*eaxp = eax;
 	if (ebxp)
@@ -293,9 +302,18 @@ xchg(volatile uint32_t *addr,uint32_t newval){
 static __inline uint64_t
 read_tsc(void)
 {
-	uint64_t tsc;
-	__asm __volatile("rdtsc" : "=A" (tsc));
-	return tsc;
+	uint32_t lo, hi;
+	__asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+// Index of the least significant set bit in 'word'.
+// The result is undefined if 'word' is zero.
+static __inline uint64_t
+bsf(uint64_t word)
+{
+	__asm __volatile("bsfq %1,%0" : "=r" (word) : "rm" (word) : "cc");
+	return word;
 }
 
 static __inline uint64_t
@@ -17,6 +17,13 @@
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Protects the input buffer and the keyboard state; vcprintf also
+// holds it across a whole message so output from different CPUs
+// doesn't interleave.
+struct spinlock console_lock = {
+	.name = "console_lock"
+};
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -424,6 +431,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&console_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -431,6 +439,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&console_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -446,13 +455,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&console_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&console_lock);
+	return c;
 }
 
 // output a character to the console
@@ -468,6 +479,7 @@ cons_putc(int c)
 void
 cons_init(void)
 {
+	spin_register(&console_lock, 1);
 	cga_init();
 	kbd_init();
 	serial_init();
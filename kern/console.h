@@ -7,6 +7,7 @@
 #endif
 
 #include <inc/types.h>
+#include <kern/spinlock.h>
 
 #define MONO_BASE	0x3B4
 #define MONO_BUF	0xB0000
@@ -17,6 +18,8 @@
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
+extern struct spinlock console_lock;
+
 void cons_init(void);
 int cons_getc(void);
 
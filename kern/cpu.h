@@ -21,8 +21,15 @@ enum {
 	CPU_HALTED,
 };
 
+// Number of free pages each CPU caches in front of the global free list
+#define PAGE_MAGAZINE 64
+
 // Per-CPU state
 struct CpuInfo {
+	// Scratch for syscall_entry in kern/trapentry.S, which reaches
+	// them through %gs before it has a stack.  Keep these first.
+	uintptr_t cpu_syscall_rsp0;     // Top of this CPU's kernel stack
+	uintptr_t cpu_syscall_ursp;     // User %rsp saved on SYSCALL
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
@@ -31,6 +38,13 @@ struct CpuInfo {
     bool is_vmx_root;               // Is the CPU in VMX root mode?
     uintptr_t vmxon_region;         // KVA of vmxon region.
 #line 37 "../kern/cpu.h"
+	struct PageInfo *cpu_pages[PAGE_MAGAZINE]; // Free pages cached by kern/pmap.c
+	int cpu_npages;                 // Number of pages in cpu_pages
+	uint64_t cpu_zero_hits;         // ALLOC_ZERO served pre-zeroed
+	uint64_t cpu_zero_misses;       // ALLOC_ZERO zeroed in page_alloc
+	uint32_t cpu_pcid_gen;          // PCID generation last flushed for
+	uint64_t cpu_halt_tsc;          // TSC when it halted; 0 while busy
+	uint64_t cpu_idle_tsc;          // Cycles spent halted in sched_halt
 };
 
 // Initialized in mpconfig.c
@@ -50,5 +64,6 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
 
 #endif
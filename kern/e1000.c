@@ -7,6 +7,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <kern/pmap.h>
+#include <kern/spinlock.h>
 
 /* Registers */
 #define E1000_STATUS   (0x00008/4)  /* Device Status - RO */
@@ -90,6 +91,14 @@
 
 static volatile uint32_t *regs;
 
+// The input and output helpers use the two rings from different CPUs.
+static struct spinlock tx_lock = {
+	.name = "e1000_tx_lock"
+};
+static struct spinlock rx_lock = {
+	.name = "e1000_rx_lock"
+};
+
 
 #define DATA_MAX 1518
 
@@ -142,6 +151,8 @@ e1000_attach(struct pci_func *pcif)
 	int i;
 
 	pci_func_enable(pcif);
+	spin_register(&tx_lock, 1);
+	spin_register(&rx_lock, 1);
 
 	// [E1000 Table 4-2] BAR 0 gives the register base address.
 	regs = mmio_map_region(pcif->reg_base[0], pcif->reg_size[0]);
@@ -201,12 +212,14 @@ e1000_transmit(const char *buf, unsigned int len)
 	if (!regs || len > DATA_MAX)
 		return -E_INVAL;
 
+	spin_lock(&tx_lock);
 	int tail = regs[E1000_TDT];
 
 	// [E1000 3.3.3.2] Check if this descriptor is done.
 	// According to [E1000 13.4.39], using TDH for this is not
 	// reliable.
 	if (!(tx_ring[tail].status & E1000_TXD_STAT_DD)) {
+		spin_unlock(&tx_lock);
 		cprintf("TX ring overflow\n");
 		return 0;
 	}
@@ -221,6 +234,7 @@ e1000_transmit(const char *buf, unsigned int len)
 
 	// Move the tail pointer
 	regs[E1000_TDT] = (tail + 1) % TX_RING_SIZE;
+	spin_unlock(&tx_lock);
 
 	return 0;
 }
@@ -231,11 +245,14 @@ e1000_receive(char *buf, unsigned int len)
 	if (!regs)
 		return 0;
 
+	spin_lock(&rx_lock);
 	int tail = (regs[E1000_RDT] + 1) % RX_RING_SIZE;
 
 	// Check if the descriptor has been filled
-	if (!(rx_ring[tail].status & E1000_RXD_STAT_DD))
+	if (!(rx_ring[tail].status & E1000_RXD_STAT_DD)) {
+		spin_unlock(&rx_lock);
 		return 0;
+	}
 	assert(rx_ring[tail].status & E1000_RXD_STAT_EOP);
 
 	// Copy the packet data
@@ -245,6 +262,7 @@ e1000_receive(char *buf, unsigned int len)
 
 	// Move the tail pointer
 	regs[E1000_RDT] = tail;
+	spin_unlock(&rx_lock);
 	return len;
 }
 
@@ -16,6 +16,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 #include <vmm/vmx.h>
 #include <vmm/ept.h>
 
@@ -24,10 +26,27 @@ int vcpu_count = 0;
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
+static struct Env *env_free_tail;	// Last env on env_free_list
 // (linked by Env->env_link)
 
+// Locking.  env_table_lock protects env_free_list, every env_status
+// change (and with it the scheduler's run queue) and which environment
+// each CPU's curenv is.  Each environment also has its own lock, kept
+// here rather than in struct Env since envs[] is mapped into user
+// space; it protects the environment's address space and IPC state.
+// An environment's lock is taken before env_table_lock, and two
+// environment locks are taken in envs[] order (see env_lock_pair).
+//
+// An environment is ENV_RUNNING exactly while it is some CPU's curenv,
+// and only that CPU changes it from ENV_RUNNING (see env_set_status).
+struct spinlock env_table_lock = {
+	.name = "env_table_lock"
+};
+static struct spinlock env_locks[NENV];
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+
 // Global descriptor table.
 //
 // Set up global descriptor table (GDT) with separate segments for
@@ -121,6 +140,74 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+// Acquire e's lock.
+void
+env_lock(struct Env *e)
+{
+	spin_lock(&env_locks[e - envs]);
+}
+
+// Release e's lock.
+void
+env_unlock(struct Env *e)
+{
+	spin_unlock(&env_locks[e - envs]);
+}
+
+// Acquire the locks of a and b, which may be the same environment.
+void
+env_lock_pair(struct Env *a, struct Env *b)
+{
+	if (a == b)
+		env_lock(a);
+	else if (a < b) {
+		env_lock(a);
+		env_lock(b);
+	} else {
+		env_lock(b);
+		env_lock(a);
+	}
+}
+
+// Release the locks taken by env_lock_pair(a, b).
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	env_unlock(a);
+	if (a != b)
+		env_unlock(b);
+}
+
+// Check, with e's lock or env_table_lock held, that e is still the
+// environment that envid2env(envid) returned: it may have been freed
+// (and its slot even reused) before the lock was acquired.
+bool
+env_is_live(struct Env *e, envid_t envid)
+{
+	return e->env_status != ENV_FREE && (envid == 0 || e->env_id == envid);
+}
+
+// Like envid2env, but on success returns with the environment's lock
+// held, so it can't be freed or have its address space changed by
+// another CPU until env_unlock.
+int
+envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, checkperm)) < 0)
+		return r;
+	env_lock(e);
+	if (!env_is_live(e, envid)) {
+		env_unlock(e);
+		*env_store = 0;
+		return -E_BAD_ENV;
+	}
+	*env_store = e;
+	return 0;
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -136,9 +223,13 @@ env_init(void)
 	for (i = 0; i < NENV; i++) {
 		envs[i].env_status = ENV_FREE;
 		envs[i].env_link = &envs[i+1];
+		__spin_initlock(&env_locks[i], "env_lock");
 	}
 	envs[NENV-1].env_link = NULL;
 	env_free_list = &envs[0];
+	env_free_tail = &envs[NENV-1];
+	spin_register(&env_table_lock, 1);
+	spin_register(env_locks, NENV);
 
 	// Per-CPU part of the initialization
 	env_init_percpu();
@@ -208,6 +299,7 @@ env_setup_vm(struct Env *e)
 	p->pp_ref       += 1;
 	e->env_pml4e    = page2kva(p);
 	e->env_cr3      = page2pa(p);
+	e->env_pcid     = p->pp_pcid = pcid_alloc();
 
 	memset(e->env_pml4e, 0, PGSIZE);
 	e->env_pml4e[1] = boot_pml4e[1];
@@ -219,9 +311,80 @@ env_setup_vm(struct Env *e)
 	return 0;
 }
 
+//
+// Set e's status, keeping the scheduler's run queue in sync.
+// The caller holds env_table_lock.
+//
+void
+env_set_status_locked(struct Env *e, unsigned status)
+{
+	unsigned old = e->env_status;
+
+	// Nothing brings a dying environment back; it is only freed.
+	if (old == ENV_DYING && status != ENV_DYING && status != ENV_FREE)
+		return;
+
+	// However a sleeping environment is woken, its sleep is over; the
+	// timer or futex_wake that was to wake it then finds nothing to do.
+	if (old == ENV_NOT_RUNNABLE)
+		e->env_sleep = ENV_SLEEP_NONE;
+
+	e->env_status = status;
+	sched_status_changed(e, old);
+
+	// Once curenv stops running, another CPU may run or free it as
+	// soon as env_table_lock is released, so this CPU lets go of it
+	// now.  env_run loads the next address space itself; everyone
+	// else must not keep using curenv's.
+	if (e == curenv && status != ENV_RUNNING) {
+		curenv = NULL;
+		if (status != ENV_RUNNABLE)
+			lcr3(boot_cr3);
+	}
+}
+
+//
+// Set e's status, keeping the scheduler's run queue in sync.
+// Every status change after env_init must go through here.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	spin_lock(&env_table_lock);
+	env_set_status_locked(e, status);
+	spin_unlock(&env_table_lock);
+}
+
+//
+// Return e to the free list, waking its parent if that is blocked in
+// sys_env_wait for it.  Freed slots go to the back of the list, so an
+// exited environment's id and exit status stay in envs[] for a late
+// sys_env_wait as long as possible.  The caller holds env_table_lock.
+//
+static void
+env_release_locked(struct Env *e)
+{
+	struct Env *p = &envs[ENVX(e->env_parent_id)];
+
+	env_set_status_locked(e, ENV_FREE);
+	if (p->env_id == e->env_parent_id && p->env_sleep == ENV_SLEEP_CHILD
+	    && p->env_wait_for == e->env_id) {
+		p->env_child_status = e->env_exit_status;
+		p->env_tf.tf_regs.reg_rax = 0;
+		env_set_status_locked(p, ENV_RUNNABLE);
+	}
+
+	e->env_link = NULL;
+	if (env_free_list)
+		env_free_tail->env_link = e;
+	else
+		env_free_list = e;
+	env_free_tail = e;
+}
+
 #ifndef VMM_GUEST
-int
-env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
+static int
+env_guest_alloc_locked(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	struct Env *e;
@@ -293,7 +456,7 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_GUEST;
-	e->env_status = ENV_RUNNABLE;
+	env_set_status_locked(e, ENV_NOT_RUNNABLE);
 
 	e->env_vmxinfo.vcpunum = vcpu_count++;
     	cprintf("VCPUNUM allocated: %d\n", e->env_vmxinfo.vcpunum);
@@ -301,7 +464,12 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	memset(&e->env_tf, 0, sizeof(e->env_tf));
 
 	e->env_pgfault_upcall = 0;
+	e->env_ring = 0;
+	memset(e->env_regions, 0, sizeof(e->env_regions));
 	e->env_ipc_recving = 0;
+	e->env_sleep = ENV_SLEEP_NONE;
+	e->env_exit_status = ENV_EXIT_KILLED;
+	e->env_ipc_maxpages = 1;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -310,6 +478,18 @@ env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+// Allocate a guest environment, which starts out ENV_NOT_RUNNABLE.
+int
+env_guest_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	int r;
+
+	spin_lock(&env_table_lock);
+	r = env_guest_alloc_locked(newenv_store, parent_id);
+	spin_unlock(&env_table_lock);
+	return r;
+}
+
 void env_guest_free(struct Env *e) {
 	// Free the VMCS.
 	page_decref(pa2page(PADDR(e->env_vmxinfo.vmcs)));
@@ -329,9 +509,9 @@ void env_guest_free(struct Env *e) {
 	e->env_cr3 = 0;
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	spin_lock(&env_table_lock);
+	env_release_locked(e);
+	spin_unlock(&env_table_lock);
 
 	cprintf("[%08x] free vmx guest env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 }
@@ -346,8 +526,8 @@ void env_guest_free(struct Env *e) {
 //	-E_NO_MEM on memory exhaustion
 //
 // CHANGED FOR LAB 0
-int
-env_alloc(struct Env **newenv_store, envid_t parent_id)
+static int
+env_alloc_locked(struct Env **newenv_store, envid_t parent_id)
 {
 	int32_t generation;
 	int r;
@@ -369,7 +549,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	env_set_status_locked(e, ENV_NOT_RUNNABLE);
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -397,9 +577,14 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_ring = 0;
+	memset(e->env_regions, 0, sizeof(e->env_regions));
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_sleep = ENV_SLEEP_NONE;
+	e->env_exit_status = ENV_EXIT_KILLED;
+	e->env_ipc_maxpages = 1;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -409,6 +594,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+//
+// Allocates and initializes a new environment, as env_alloc_locked.
+// The new environment is ENV_NOT_RUNNABLE; the caller makes it
+// runnable once it is fully set up.
+//
+int
+env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	int r;
+
+	spin_lock(&env_table_lock);
+	r = env_alloc_locked(newenv_store, parent_id);
+	spin_unlock(&env_table_lock);
+	return r;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -525,6 +726,8 @@ env_create(uint8_t *binary, enum EnvType type)
 	// LAB 5: Your code here.
 	if (type == ENV_TYPE_FS)
 		e->env_tf.tf_eflags |= FL_IOPL_3;
+
+	env_set_status(e, ENV_RUNNABLE);
 }
 
 //
@@ -533,13 +736,15 @@ env_create(uint8_t *binary, enum EnvType type)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint64_t pdeno, pteno;
 	physaddr_t pa;
 
+	// Wait out anyone still working on e's address space.
+	env_lock(e);
+
 #ifndef VMM_GUEST
 	if(e->env_type == ENV_TYPE_GUEST) {
 		env_guest_free(e);
+		env_unlock(e);
 		return;
 	}
 #endif
@@ -553,56 +758,32 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
-	pdpe_t *env_pdpe = KADDR(PTE_ADDR(e->env_pml4e[0]));
-	int pdeno_limit;
-	uint64_t pdpe_index;
-	// using 3 instead of NPDPENTRIES as we have only first three indices
-	// set for 4GB of address space.
-	for(pdpe_index=0;pdpe_index<=3;pdpe_index++){
-		if(!(env_pdpe[pdpe_index] & PTE_P))
-			continue;
-		pde_t *env_pgdir = KADDR(PTE_ADDR(env_pdpe[pdpe_index]));
-		pdeno_limit  = pdpe_index==3?PDX(UTOP):PDX(0xFFFFFFFF);
-		static_assert(UTOP % PTSIZE == 0);
-		for (pdeno = 0; pdeno < pdeno_limit; pdeno++) {
-
-			// only look at mapped page tables
-			if (!(env_pgdir[pdeno] & PTE_P))
-				continue;
-			// find the pa and va of the page table
-			pa = PTE_ADDR(env_pgdir[pdeno]);
-			pt = (pte_t*) KADDR(pa);
-
-			// unmap all PTEs in this page table
-			for (pteno = 0; pteno < PTX(~0); pteno++) {
-				if (pt[pteno] & PTE_P){
-					page_remove(e->env_pml4e, PGADDR((uint64_t)0,pdpe_index,pdeno, pteno, 0));
-				}
-			}
+	// Drop all mapped pages in the user portion of the address space
+	// (a failed fork can leave the user half unallocated).  An idle
+	// CPU frees the page tables later.
+	pml4e_teardown(e->env_pml4e);
 
-			// free the page table itself
-			env_pgdir[pdeno] = 0;
-			page_decref(pa2page(pa));
-		}
-		// free the page directory
-		pa = PTE_ADDR(env_pdpe[pdpe_index]);
-		env_pdpe[pdpe_index] = 0;
-		page_decref(pa2page(pa));
-	}
-	// free the page directory pointer
-	page_decref(pa2page(PTE_ADDR(e->env_pml4e[0])));
-	// free the page map level 4 (PML4)
+	// free the page map level 4 (PML4) and its PCID
 	e->env_pml4e[0] = 0;
 	pa = e->env_cr3;
 	e->env_pml4e = 0;
 	e->env_cr3 = 0;
-	page_decref(pa2page(pa));
+
+	// Messages nobody will receive now.
+	ipc_queue_flush(e);
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
-	e->env_link = env_free_list;
-	env_free_list = e;
+	spin_lock(&env_table_lock);
+	pcid_free(e->env_pcid);
+	pa2page(pa)->pp_pcid = e->env_pcid = 0;
+	env_release_locked(e);
+	spin_unlock(&env_table_lock);
+	env_unlock(e);
+
+	page_decref(pa2page(pa));
+
+	// Wake anyone blocked in wait() on this environment's exit.
+	futex_wake_pa(PADDR(&e->env_status), NENV);
 }
 
 //
@@ -613,19 +794,48 @@ env_free(struct Env *e)
 void
 env_destroy(struct Env *e)
 {
-	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
-		return;
+	env_destroy_checked(e, 0);
+}
+
+//
+// Like env_destroy, for an environment e that envid2env returned for
+// 'envid'.  Returns -E_BAD_ENV, without touching e, if it has been
+// freed since.
+//
+int
+env_destroy_checked(struct Env *e, envid_t envid)
+{
+	bool self = (e == curenv);
+
+	spin_lock(&env_table_lock);
+	if (!env_is_live(e, envid)) {
+		spin_unlock(&env_table_lock);
+		return -E_BAD_ENV;
 	}
+	if (!self) {
+		// If e is currently running on other CPUs, we change its
+		// state to ENV_DYING. A zombie environment will be freed
+		// the next time it traps to the kernel.
+		if (e->env_status == ENV_RUNNING) {
+			env_set_status_locked(e, ENV_DYING);
+			spin_unlock(&env_table_lock);
+			return 0;
+		}
+		// Someone else is already freeing it.
+		if (e->env_status == ENV_DYING) {
+			spin_unlock(&env_table_lock);
+			return 0;
+		}
+	}
+	// Take e off the run queue (and off this CPU) so that nobody
+	// runs or frees it while we do.
+	env_set_status_locked(e, ENV_DYING);
+	spin_unlock(&env_table_lock);
 
 	env_free(e);
-	if (curenv == e) {
-		curenv = NULL;
+	if (self)
 		sched_yield();
-	}
+	return 0;
 }
 
 
@@ -662,9 +872,10 @@ void
 env_run(struct Env *e)
 {
 	// Is this a context switch or just a return?
+	// A switch comes from sched_yield, with env_table_lock held.
 	if (curenv != e) {
 		if (curenv && curenv->env_status == ENV_RUNNING)
-			curenv->env_status = ENV_RUNNABLE;
+			env_set_status_locked(curenv, ENV_RUNNABLE);
 
 		//cprintf("cpu %d switch from env %d to env %d\n",
 		//	cpunum(), curenv ? curenv - envs : -1, e - envs);
@@ -672,18 +883,22 @@ env_run(struct Env *e)
 		// keep track of which environment we're currently
 		// running
 		curenv = e;
-		e->env_status = ENV_RUNNING;
+		env_set_status_locked(e, ENV_RUNNING);
         e->env_runs++;
 
 		// Hint, Lab 0: An environment has started running. We should keep track of that somewhere, right?
 		
 		// restore e's address space
 		if(e->env_type != ENV_TYPE_GUEST) {
-			lcr3(e->env_cr3);
-		}
+			pcid_lcr3(e->env_cr3, e->env_pcid);
+		} else
+			lcr3(boot_cr3);
+		spin_unlock(&env_table_lock);
 	}
 
-	assert(e->env_status == ENV_RUNNING);
+	// Another CPU may have just destroyed e; it is freed the next
+	// time it enters the kernel.
+	assert(e->env_status == ENV_RUNNING || e->env_status == ENV_DYING);
 
 
 #ifndef VMM_GUEST
@@ -697,11 +912,9 @@ env_run(struct Env *e)
 		panic ("vmx_run never returns\n");
 	}
 	else {
-		unlock_kernel();
 		env_pop_tf(&e->env_tf);
 	}
 #else	/* VMM_GUEST */
-	unlock_kernel();
 	env_pop_tf(&e->env_tf);
 #endif
 
@@ -7,6 +7,7 @@
 #include <inc/env.h>
 #line 9 "../kern/env.h"
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 #line 11 "../kern/env.h"
 
 extern struct Env *envs;		// All environments
@@ -14,6 +15,7 @@ extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 #line 18 "../kern/env.h"
 extern struct Segdesc gdt[];
+extern struct spinlock env_table_lock;
 
 void	env_init(void);
 void	env_init_percpu(void);
@@ -21,8 +23,17 @@ int	env_alloc(struct Env **e, envid_t parent_id);
 void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, enum EnvType type);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
+int	env_destroy_checked(struct Env *e, envid_t envid);
+void	env_set_status(struct Env *e, unsigned status);
+void	env_set_status_locked(struct Env *e, unsigned status);
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	envid2env_lock(envid_t envid, struct Env **env_store, bool checkperm);
+void	env_lock(struct Env *e);
+void	env_unlock(struct Env *e);
+void	env_lock_pair(struct Env *a, struct Env *b);
+void	env_unlock_pair(struct Env *a, struct Env *b);
+bool	env_is_live(struct Env *e, envid_t envid);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -0,0 +1,195 @@
+// Futexes let environments block until a word of memory changes.
+// Waiters are keyed by the physical address of the word, so
+// environments that share a page (PTE_SHARE pages, or envs[] at
+// UENVS) meet on the same key wherever each of them maps it.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+#include <kern/futex.h>
+
+// One waiter per envs[] slot, on the hash chain for its address.  A
+// waiter can stay on its chain after its wait is over -- when the
+// environment was made runnable some other way, or freed -- so only
+// waiters whose environment is still blocked in futex_wait count.
+struct FutexWaiter {
+	struct FutexWaiter *fw_next;
+	struct FutexWaiter **fw_pprev;	// NULL if not on a chain
+	physaddr_t fw_pa;		// Address waited on
+	envid_t fw_envid;		// Environment waiting
+	struct timer fw_timer;		// Ends a wait that has a timeout
+};
+
+#define FUTEX_HASH	64
+
+// futex_lock protects the waiters and chains.  It is taken after an
+// environment's lock and timer_lock, and before env_table_lock.
+static struct FutexWaiter waiters[NENV];
+static struct FutexWaiter *chains[FUTEX_HASH];
+static struct spinlock futex_lock = { .name = "futex_lock" };
+
+void
+futex_init(void)
+{
+	spin_register(&futex_lock, 1);
+}
+
+static struct FutexWaiter **
+futex_chain(physaddr_t pa)
+{
+	return &chains[((pa >> 2) ^ (pa >> PGSHIFT)) % FUTEX_HASH];
+}
+
+static void
+waiter_unlink(struct FutexWaiter *w)
+{
+	if (w->fw_pprev) {
+		if ((*w->fw_pprev = w->fw_next))
+			w->fw_next->fw_pprev = w->fw_pprev;
+		w->fw_pprev = NULL;
+	}
+}
+
+// Take w off its chain and, if its environment is still waiting, make
+// it runnable with sys_futex_wait returning 'r'.  The caller holds
+// futex_lock and env_table_lock.  Returns 1 if it woke someone.
+static int
+waiter_wake(struct FutexWaiter *w, int r)
+{
+	struct Env *e = &envs[ENVX(w->fw_envid)];
+
+	waiter_unlink(w);
+	if (e->env_id != w->fw_envid || e->env_sleep != ENV_SLEEP_FUTEX)
+		return 0;
+	e->env_tf.tf_regs.reg_rax = r;
+	env_set_status_locked(e, ENV_RUNNABLE);
+	return 1;
+}
+
+static void
+futex_timeout(uint64_t envx)
+{
+	struct FutexWaiter *w = &waiters[envx];
+
+	spin_lock(&futex_lock);
+	spin_lock(&env_table_lock);
+	if (w->fw_pprev)
+		waiter_wake(w, -E_TIMEOUT);
+	spin_unlock(&env_table_lock);
+	spin_unlock(&futex_lock);
+}
+
+// Return the physical address of the word at va in e, which the
+// caller has checked is mapped and holds e's lock.
+static physaddr_t
+futex_key(struct Env *e, const uint32_t *va)
+{
+	pte_t *pte = pml4e_walk(e->env_pml4e, va, 0);
+	uintptr_t mask = page_is_large(e->env_pml4e, va) ? PTSIZE - 1 : PGSIZE - 1;
+
+	return PTE_ADDR(*pte & ~mask) | ((uintptr_t) va & mask);
+}
+
+// Block curenv until futex_wake is called on va, provided *va still
+// equals val.  With a non-zero timeout, give up after that many
+// milliseconds.  The wait may also end early if another environment
+// makes curenv runnable, so callers recheck their condition.
+//
+// Returns 0 when woken (the system call returns it once curenv runs
+// again), or
+//	-E_INVAL if va is not aligned to 4 bytes,
+//	-E_AGAIN if *va != val,
+//	-E_TIMEOUT (also as the eventual return value) on timeout.
+int
+futex_wait(const uint32_t *va, uint32_t val, unsigned int timeout)
+{
+	struct Env *e = curenv;
+	struct FutexWaiter *w = &waiters[ENVX(e->env_id)];
+	unsigned int deadline = time_msec() + timeout;
+	struct FutexWaiter **chain;
+	int r;
+
+	if ((uintptr_t) va % sizeof(*va))
+		return -E_INVAL;
+
+	// Arm the timeout before taking futex_lock, since the timer
+	// takes it.  If the timer goes off before we block, the deadline
+	// check below sees that.
+	if (!w->fw_timer.t_func)
+		timer_init(&w->fw_timer, futex_timeout, w - waiters);
+	if (timeout)
+		timer_set(&w->fw_timer, time_msec_to_ticks(deadline));
+	else
+		timer_cancel(&w->fw_timer);
+
+	// Our lock keeps va mapped while we read it.  A waker changes *va
+	// before it takes futex_lock, so checking *va and queueing under
+	// futex_lock can't miss a wakeup.
+	user_mem_lock(e, va, sizeof(*va), 0);
+	spin_lock(&futex_lock);
+	if (*va != val)
+		r = -E_AGAIN;
+	else if (timeout && time_msec() >= deadline)
+		r = -E_TIMEOUT;
+	else {
+		waiter_unlink(w);
+		w->fw_pa = futex_key(e, va);
+		w->fw_envid = e->env_id;
+		chain = futex_chain(w->fw_pa);
+		if ((w->fw_next = *chain))
+			w->fw_next->fw_pprev = &w->fw_next;
+		w->fw_pprev = chain;
+		*chain = w;
+
+		e->env_tf.tf_regs.reg_rax = 0;
+		spin_lock(&env_table_lock);
+		env_set_status_locked(e, ENV_NOT_RUNNABLE);
+		if (e->env_status == ENV_NOT_RUNNABLE)
+			e->env_sleep = ENV_SLEEP_FUTEX;
+		spin_unlock(&env_table_lock);
+		r = 0;
+	}
+	spin_unlock(&futex_lock);
+	env_unlock(e);
+
+	if (r == 0)
+		sched_yield();
+	return r;
+}
+
+// Wake up to n environments waiting on the word at va in curenv.
+// Returns the number woken.
+int
+futex_wake(const uint32_t *va, int n)
+{
+	physaddr_t pa;
+
+	user_mem_lock(curenv, va, sizeof(*va), 0);
+	pa = futex_key(curenv, va);
+	env_unlock(curenv);
+	return futex_wake_pa(pa, n);
+}
+
+// Wake up to n environments waiting on physical address pa.
+int
+futex_wake_pa(physaddr_t pa, int n)
+{
+	struct FutexWaiter *w, *next;
+	int woken = 0;
+
+	spin_lock(&futex_lock);
+	spin_lock(&env_table_lock);
+	for (w = *futex_chain(pa); w && woken < n; w = next) {
+		next = w->fw_next;
+		if (w->fw_pa == pa)
+			woken += waiter_wake(w, 0);
+	}
+	spin_unlock(&env_table_lock);
+	spin_unlock(&futex_lock);
+	return woken;
+}
@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+void futex_init(void);
+int futex_wait(const uint32_t *va, uint32_t val, unsigned int timeout);
+int futex_wake(const uint32_t *va, int n);
+int futex_wake_pa(physaddr_t pa, int n);
+
+#endif	// !JOS_KERN_FUTEX_H
@@ -20,6 +20,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 #line 27 "../kern/init.c"
 #include <kern/time.h>
 #include <kern/pci.h>
@@ -100,6 +101,7 @@ i386_init(void)
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	futex_init();
 	trap_init();
 #line 130 "../kern/init.c"
 
@@ -121,17 +123,6 @@ i386_init(void)
 #endif 
 #line 154 "../kern/init.c"
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-#line 158 "../kern/init.c"
-	lock_kernel();
-#line 160 "../kern/init.c"
-
-#line 162 "../kern/init.c"
-#ifndef VMM_GUEST
-	// Starting non-boot CPUs
-	boot_aps();
-#endif
 #line 170 "../kern/init.c"
 
 #line 172 "../kern/init.c"
@@ -164,6 +155,12 @@ i386_init(void)
 	kbd_intr();
 #line 221 "../kern/init.c"
 
+#ifndef VMM_GUEST
+	// Starting non-boot CPUs.  They go straight into the scheduler,
+	// so only start them once the initial environments exist.
+	boot_aps();
+#endif
+
 #line 223 "../kern/init.c"
 	// Schedule and run the first user environment!
 	sched_yield();
@@ -208,6 +205,7 @@ mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
 	lcr3(boot_cr3);
+	pcid_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -216,12 +214,8 @@ mp_main(void)
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
-	//
-	// Your code here:
+	// to start running processes on this CPU.
 #line 293 "../kern/init.c"
-	lock_kernel();
 	sched_yield();     // start running processes
 #line 300 "../kern/init.c"
 }
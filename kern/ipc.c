@@ -0,0 +1,142 @@
+// IPC message queues.  A message sent to an environment that isn't
+// blocked in sys_ipc_recv waits in the receiver's queue, holding a
+// reference to the pages it carries, and is handed over by the
+// receiver's next sys_ipc_recv.  Each queue is protected by the
+// receiving environment's lock.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/ipc.h>
+
+struct IpcMsg {
+	envid_t im_from;		// Sender
+	uint32_t im_value;
+	struct PageInfo *im_pages[IPC_MAXPAGES];	// Pages sent
+	int im_npages;
+	int im_perm;			// Their permissions
+};
+
+// iq_head and iq_tail only grow; the queue is empty when they are
+// equal and full when they are IPC_QLEN apart.
+struct IpcQueue {
+	struct IpcMsg iq_msgs[IPC_QLEN];
+	uint32_t iq_head;
+	uint32_t iq_tail;
+};
+
+static struct IpcQueue queues[NENV];
+
+//
+// Map 'pages' at e->env_ipc_dstva with 'perm', as many of them as e
+// accepts and as fit below UTOP.  Either all of those are mapped or,
+// on error, e's mappings are left as they were: everything that can
+// fail is done before the first page is mapped.
+// Returns the number of pages mapped, -E_NO_MEM if a page table
+// couldn't be allocated, or -E_INVAL if the range crosses a large page.
+//
+int
+ipc_map_pages(struct Env *e, struct PageInfo **pages, int npages, int perm)
+{
+	uint8_t *dstva = e->env_ipc_dstva;
+	int i, r;
+
+	npages = MIN(npages, e->env_ipc_maxpages);
+	npages = MIN(npages, (int) (((uint8_t *) UTOP - dstva) / PGSIZE));
+	for (i = 0; i < npages; i++) {
+		if (page_is_large(e->env_pml4e, dstva + i * PGSIZE))
+			return -E_INVAL;
+		if (!pml4e_walk(e->env_pml4e, dstva + i * PGSIZE, 1))
+			return -E_NO_MEM;
+	}
+	for (i = 0; i < npages; i++)
+		if ((r = page_insert(e->env_pml4e, pages[i],
+				     dstva + i * PGSIZE, perm)) < 0)
+			panic("ipc_map_pages: %e", r);
+	return npages;
+}
+
+//
+// Queue a message from curenv for e.  The queue keeps a reference to
+// each of the 'npages' pages until the message is received.
+// Returns 0 on success, -E_IPC_NOT_RECV if e's queue is full.
+//
+int
+ipc_enqueue(struct Env *e, uint32_t value, struct PageInfo **pages,
+	    int npages, int perm)
+{
+	struct IpcQueue *q = &queues[ENVX(e->env_id)];
+	struct IpcMsg *m;
+	int i;
+
+	if (q->iq_tail - q->iq_head == IPC_QLEN)
+		return -E_IPC_NOT_RECV;
+	m = &q->iq_msgs[q->iq_tail++ % IPC_QLEN];
+	m->im_from = curenv->env_id;
+	m->im_value = value;
+	m->im_npages = npages;
+	m->im_perm = npages ? perm : 0;
+	for (i = 0; i < npages; i++) {
+		m->im_pages[i] = pages[i];
+		__sync_fetch_and_add(&pages[i]->pp_ref, 1);
+	}
+	return 0;
+}
+
+static void
+ipc_msg_release(struct IpcMsg *m)
+{
+	int i;
+
+	for (i = 0; i < m->im_npages; i++)
+		page_decref(m->im_pages[i]);
+}
+
+//
+// Deliver the oldest message queued for e as if it had been sent
+// while e was receiving at e->env_ipc_dstva.  Pages that can't be
+// mapped there (no dstva, or out of memory) are dropped, and the
+// message arrives with env_ipc_perm 0.
+// Returns false, changing nothing, if the queue is empty.
+//
+bool
+ipc_dequeue(struct Env *e)
+{
+	struct IpcQueue *q = &queues[ENVX(e->env_id)];
+	struct IpcMsg *m;
+	int r;
+
+	if (q->iq_head == q->iq_tail)
+		return false;
+	m = &q->iq_msgs[q->iq_head++ % IPC_QLEN];
+
+	e->env_ipc_perm = 0;
+	e->env_ipc_npages = 0;
+	if (m->im_npages && e->env_ipc_dstva < (void *) UTOP &&
+	    (r = ipc_map_pages(e, m->im_pages, m->im_npages, m->im_perm)) > 0) {
+		e->env_ipc_perm = m->im_perm;
+		e->env_ipc_npages = r;
+	}
+	ipc_msg_release(m);
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = m->im_from;
+	e->env_ipc_value = m->im_value;
+	return true;
+}
+
+//
+// Drop every message queued for e, which is being freed.
+//
+void
+ipc_queue_flush(struct Env *e)
+{
+	struct IpcQueue *q = &queues[ENVX(e->env_id)];
+	struct IpcMsg *m;
+
+	while (q->iq_head != q->iq_tail) {
+		m = &q->iq_msgs[q->iq_head++ % IPC_QLEN];
+		ipc_msg_release(m);
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+struct PageInfo;
+
+// Messages an environment can have waiting for it.
+#define IPC_QLEN	8
+
+int ipc_map_pages(struct Env *e, struct PageInfo **pages, int npages,
+		  int perm);
+int ipc_enqueue(struct Env *e, uint32_t value, struct PageInfo **pages,
+		int npages, int perm);
+bool ipc_dequeue(struct Env *e);
+void ipc_queue_flush(struct Env *e);
+
+#endif	// !JOS_KERN_IPC_H
@@ -1,7 +1,8 @@
 #line 2 "../kern/kclock.c"
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for
+ * timing short delays with the programmable interval timer. */
 
 #include <inc/x86.h>
 
@@ -21,3 +22,21 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Busy-wait for 'usec' microseconds, at most 54ms, on PIT channel 2.
+// That channel only drives the PC speaker, so nothing else minds.
+// Used to calibrate the LAPIC timer and the TSC at boot.
+void
+pit_delay(unsigned int usec)
+{
+	unsigned int count = (uint64_t) usec * PIT_HZ / 1000000;
+
+	// Gate channel 2 on, keeping the speaker off, then load it in
+	// mode 0: its output goes high when the count reaches zero.
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+	outb(IO_PIT + 3, 0xb0);
+	outb(IO_PIT + 2, count & 0xff);
+	outb(IO_PIT + 2, count >> 8);
+	while (!(inb(IO_PORTB) & 0x20))
+		;
+}
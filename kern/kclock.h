@@ -8,6 +8,10 @@
 #endif
 
 #define	IO_RTC		0x070		/* RTC port */
+#define	IO_PIT		0x040		/* 8254 interval timer ports */
+#define	IO_PORTB	0x061		/* PIT channel 2 gate and output */
+
+#define	PIT_HZ		1193182		/* PIT input clock */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
 #define	MC_NVRAM_SIZE	50	/* 50 bytes of NVRAM */
@@ -33,5 +37,6 @@
 
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+void pit_delay(unsigned int usec);
 
 #endif	// !JOS_KERN_KCLOCK_H
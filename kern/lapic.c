@@ -10,6 +10,8 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/kclock.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -53,6 +55,35 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// LAPIC timer counts per second, measured once by the boot CPU.
+static uint32_t lapic_timer_hz;
+
+// How long to count the LAPIC timer and the TSC against the PIT
+#define CALIBRATE_USEC	10000
+
+// Measure the rates of the LAPIC timer and the TSC against the PIT.
+// The TSC is assumed to tick at the same rate on every CPU.
+static void
+lapic_calibrate(void)
+{
+	uint64_t tsc;
+	uint32_t left;
+
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xffffffff);
+	tsc = read_tsc();
+	pit_delay(CALIBRATE_USEC);
+	left = lapic[TCCR];
+	tsc = read_tsc() - tsc;
+
+	lapic_timer_hz = (0xffffffff - left) * (1000000 / CALIBRATE_USEC);
+	time_set_tsc_hz(tsc * (1000000 / CALIBRATE_USEC));
+	cprintf("LAPIC timer %u kHz, TSC %llu kHz, %u ticks/s\n",
+		lapic_timer_hz / 1000, tsc * (1000000 / CALIBRATE_USEC) / 1000,
+		HZ);
+}
+
 void
 lapic_init(void)
 {
@@ -67,12 +98,13 @@ lapic_init(void)
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
 	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// from lapic[TICR] and then issues an interrupt, HZ times
+	// a second once calibrated against the PIT.
+	if (!lapic_timer_hz)
+		lapic_calibrate();
 	lapicw(TDCR, X1);
 	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TICR, lapic_timer_hz / HZ);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -135,8 +167,6 @@ microdelay(int us)
 {
 }
 
-#define IO_RTC  0x70
-
 // Start additional processor running entry code at addr.
 // See Appendix B of MultiProcessor Specification.
 void
@@ -181,3 +211,13 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the CPU with local APIC ID 'apicid'.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
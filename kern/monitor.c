@@ -14,6 +14,9 @@
 #include <kern/dwarf_api.h>
 #line 16 "../kern/monitor.c"
 #include <kern/trap.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 #line 18 "../kern/monitor.c"
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -34,6 +37,9 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 #line 36 "../kern/monitor.c"
 	{ "backtrace", "Display a stack backtrace", mon_backtrace },
+	{ "meminfo", "Display physical memory usage", mon_meminfo },
+	{ "lockstat", "Display spinlock contention ('lockstat reset' clears it)", mon_lockstat },
+	{ "idlestat", "Display time each CPU spent halted ('idlestat reset' clears it)", mon_idlestat },
 #line 39 "../kern/monitor.c"
 #ifdef VMM_GUEST
 	{ "exit", "Exit VMM guest", mon_exit },
@@ -72,6 +78,64 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int
+mon_meminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t nfree = page_free_count();
+	uint64_t hits = 0, misses = 0;
+	int i;
+
+	cprintf("Physical memory: %ldKB total, %ldKB free\n",
+		npages * PGSIZE / 1024, nfree * PGSIZE / 1024);
+	for (i = 0; i < ncpu; i++) {
+		hits += cpus[i].cpu_zero_hits;
+		misses += cpus[i].cpu_zero_misses;
+	}
+	cprintf("Zeroed page pool: %ld hits, %ld misses\n", hits, misses);
+	return 0;
+}
+
+int
+mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		spin_reset_stats();
+	else
+		spin_print_stats();
+	return 0;
+}
+
+// TSC value that idle times are measured from: boot, or the last
+// 'idlestat reset'.
+static uint64_t idle_epoch;
+
+int
+mon_idlestat(int argc, char **argv, struct Trapframe *tf)
+{
+	uint64_t now = read_tsc(), idle;
+	int i;
+
+	if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+		for (i = 0; i < ncpu; i++) {
+			cpus[i].cpu_idle_tsc = 0;
+			if (cpus[i].cpu_halt_tsc)
+				cpus[i].cpu_halt_tsc = now;
+		}
+		idle_epoch = now;
+		return 0;
+	}
+
+	for (i = 0; i < ncpu; i++) {
+		// A CPU that is still halted hasn't counted this halt yet.
+		idle = cpus[i].cpu_idle_tsc;
+		if (cpus[i].cpu_halt_tsc)
+			idle += now - cpus[i].cpu_halt_tsc;
+		cprintf("CPU %d: %llu cycles idle (%llu%%)\n",
+			i, idle, idle * 100 / (now - idle_epoch));
+	}
+	return 0;
+}
+
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
@@ -14,6 +14,8 @@
 #include <kern/env.h>
 #line 17 "../kern/pmap.c"
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
 #line 19 "../kern/pmap.c"
 
 extern uint64_t pml4phys;
@@ -29,6 +31,23 @@ pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 struct PageInfo *pages;		// Physical page state array
 static struct PageInfo *page_free_list;	// Free list of physical pages
+static size_t page_free_list_len;	// Number of pages on page_free_list
+static struct PageInfo *page_zero_list;	// Free pages already zeroed
+static size_t page_zero_list_len;	// Number of pages on page_zero_list
+
+#define PAGE_ZERO_POOL	512	// Pages idle CPUs keep zeroed
+#define PAGE_ZERO_BATCH	16	// Pages zeroed per trip to page_free_list
+
+// Protects page_free_list and page_zero_list.  Most allocations never take it: they are
+// served from the allocating CPU's magazine (cpu_pages in CpuInfo).
+static struct spinlock page_lock = {
+	.name = "page_lock"
+};
+
+// Protect each CPU's magazine.  Only its own CPU takes one, except when
+// another CPU runs out of pages and empties it (magazine_steal).  Taken
+// before page_lock.
+static struct spinlock magazine_locks[NCPU];
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -290,6 +309,10 @@ x64_vm_init(void)
 	envs    = boot_alloc(sizeof(struct Env)*NENV);
 	memset(envs, 0, sizeof(struct Env)*NENV);
 
+	// Allocate the page that kern/time.c publishes the clock in.
+	timepage = boot_alloc(PGSIZE);
+	memset(timepage, 0, PGSIZE);
+
 #line 304 "../kern/pmap.c"
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -324,6 +347,10 @@ x64_vm_init(void)
 #line 336 "../kern/pmap.c"
 	n   = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
 	boot_map_region(boot_pml4e, UENVS, n, PADDR(envs), PTE_U|PTE_P);
+
+	// The time page shares the UENVS region, after the envs array.
+	static_assert(NENV * sizeof(struct Env) <= UTIME - UENVS);
+	boot_map_region(boot_pml4e, UTIME, PGSIZE, PADDR(timepage), PTE_U|PTE_P);
 #line 340 "../kern/pmap.c"
 
 #line 342 "../kern/pmap.c"
@@ -365,6 +392,7 @@ x64_vm_init(void)
 	pdpe_t *pdpe = KADDR(PTE_ADDR(pml4e[1]));
 	pde_t *pgdir = KADDR(PTE_ADDR(pdpe[0]));
 	lcr3(boot_cr3);
+	pcid_init_percpu();
 }
 
 
@@ -429,6 +457,11 @@ page_init(void)
 	size_t i;
 	int inuse;
 	struct PageInfo* last = NULL;
+
+	spin_register(&page_lock, 1);
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&magazine_locks[i], "magazine_lock");
+	spin_register(magazine_locks, NCPU);
 	for (i = 0; i < npages; i++) {
 		// Off-limits until proven otherwise.
 		inuse = 1;
@@ -453,12 +486,14 @@ page_init(void)
 
 		pages[i].pp_ref = inuse;
 		pages[i].pp_link = NULL;
+		pages[i].pp_flags = inuse ? 0 : PP_FREE;
 		if (!inuse) {
 			if (last)
 				last->pp_link = &pages[i];
 			else
 				page_free_list = &pages[i];
 			last = &pages[i];
+			page_free_list_len++;
 		}
 
 	}
@@ -466,6 +501,141 @@ page_init(void)
 #line 521 "../kern/pmap.c"
 }
 
+// Push 'pp' onto page_free_list.  The caller holds page_lock.
+static void
+page_free_list_push(struct PageInfo *pp)
+{
+	pp->pp_link = page_free_list;
+	pp->pp_flags |= PP_FREE;
+	page_free_list = pp;
+	page_free_list_len++;
+}
+
+// Move up to 'n' pages from page_free_list into c's magazine.
+// The caller holds c's magazine lock.
+static void
+magazine_refill(struct CpuInfo *c, int n)
+{
+	struct PageInfo *pp;
+
+	spin_lock(&page_lock);
+	while (n-- > 0 && (pp = page_free_list)) {
+		page_free_list = pp->pp_link;
+		page_free_list_len--;
+		pp->pp_link = NULL;
+		pp->pp_flags &= ~PP_FREE;
+		c->cpu_pages[c->cpu_npages++] = pp;
+	}
+	spin_unlock(&page_lock);
+}
+
+// Return the 'n' least recently freed pages in c's magazine to
+// page_free_list, keeping the cache-hot ones on this CPU.
+// The caller holds c's magazine lock.
+static void
+magazine_drain(struct CpuInfo *c, int n)
+{
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n; i++)
+		page_free_list_push(c->cpu_pages[i]);
+	spin_unlock(&page_lock);
+	c->cpu_npages -= n;
+	memmove(c->cpu_pages, c->cpu_pages + n,
+		c->cpu_npages * sizeof(c->cpu_pages[0]));
+}
+
+// Pop a page off c's magazine, refilling it from page_free_list first
+// if it is empty.  Returns NULL if both are empty.
+static struct PageInfo *
+magazine_pop(struct CpuInfo *c)
+{
+	struct spinlock *lk = &magazine_locks[c - cpus];
+	struct PageInfo *pp = NULL;
+
+	spin_lock(lk);
+	if (c->cpu_npages == 0)
+		magazine_refill(c, PAGE_MAGAZINE / 2);
+	if (c->cpu_npages > 0)
+		pp = c->cpu_pages[--c->cpu_npages];
+	spin_unlock(lk);
+	return pp;
+}
+
+// Return the pages cached in every other CPU's magazine to
+// page_free_list, for a CPU that has run out.
+static void
+magazine_steal(struct CpuInfo *c)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (&cpus[i] == c || cpus[i].cpu_npages == 0)
+			continue;
+		spin_lock(&magazine_locks[i]);
+		magazine_drain(&cpus[i], cpus[i].cpu_npages);
+		spin_unlock(&magazine_locks[i]);
+	}
+}
+
+// Pop a page off page_zero_list, or return NULL if it is empty.
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!page_zero_list)
+		return NULL;
+	spin_lock(&page_lock);
+	if ((pp = page_zero_list)) {
+		page_zero_list = pp->pp_link;
+		page_zero_list_len--;
+		pp->pp_link = NULL;
+	}
+	spin_unlock(&page_lock);
+	return pp;
+}
+
+//
+// Move up to 'n' pages from page_free_list to page_zero_list, zeroing
+// them without holding any lock, until the pool holds PAGE_ZERO_POOL
+// pages.  Called by idle CPUs from sched_halt, so that
+// page_alloc(ALLOC_ZERO) rarely has to zero a page itself.
+//
+void
+page_zero_fill(int n)
+{
+	struct PageInfo *batch[PAGE_ZERO_BATCH], *pp;
+	int i, m;
+
+	while (n > 0 && page_zero_list_len < PAGE_ZERO_POOL) {
+		spin_lock(&page_lock);
+		for (m = 0; m < MIN(n, PAGE_ZERO_BATCH) && (pp = page_free_list); m++) {
+			page_free_list = pp->pp_link;
+			page_free_list_len--;
+			pp->pp_link = NULL;
+			pp->pp_flags &= ~PP_FREE;
+			batch[m] = pp;
+		}
+		spin_unlock(&page_lock);
+		if (m == 0)
+			return;
+
+		for (i = 0; i < m; i++)
+			memset(page2kva(batch[i]), 0, PGSIZE);
+
+		spin_lock(&page_lock);
+		for (i = 0; i < m; i++) {
+			batch[i]->pp_link = page_zero_list;
+			page_zero_list = batch[i];
+		}
+		page_zero_list_len += m;
+		spin_unlock(&page_lock);
+		n -= m;
+	}
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -477,24 +647,98 @@ page_init(void)
 //
 // Returns NULL if out of free memory.
 //
+// Pages come from this CPU's magazine, which is refilled from
+// page_free_list half a magazine at a time when it runs dry.
+// ALLOC_ZERO requests are served from page_zero_list first.
+// Only when page_free_list is empty too does it reclaim dead page
+// tables and the other CPUs' magazines.
+//
 // Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
 #line 540 "../kern/pmap.c"
-	struct PageInfo *pp = page_free_list;
-	if (pp) {
-		//cprintf("alloc new page: struct page %x va %x pa %x \n", pp, page2kva(pp), page2pa(pp));
-		page_free_list = page_free_list->pp_link;
-		pp->pp_link = NULL;
-		if (alloc_flags & ALLOC_ZERO)
-			memset(page2kva(pp), 0, PGSIZE);
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_ZERO) && (pp = page_zero_pop())) {
+		c->cpu_zero_hits++;
+		return pp;
+	}
+	if (!(pp = magazine_pop(c))) {
+		// Out of free pages: take back the page tables of dead
+		// environments that no idle CPU has freed yet, then the
+		// pages other CPUs have cached.
+		pt_reap(PAGE_MAGAZINE / 2);
+		if (!(pp = magazine_pop(c))) {
+			magazine_steal(c);
+			pp = magazine_pop(c);
+		}
+	}
+	if (!pp)
+		return page_zero_pop();
+	if (alloc_flags & ALLOC_ZERO) {
+		c->cpu_zero_misses++;
+		memset(page2kva(pp), 0, PGSIZE);
 	}
 	return pp;
 #line 552 "../kern/pmap.c"
 }
 
+//
+// Allocates NPTENTRIES physically contiguous, PTSIZE-aligned pages to
+// back one 2MB page.  The first page is returned, marked PP_LARGE, and
+// carries the reference count for the whole run; page_free of it
+// returns all NPTENTRIES pages to the free list.
+//
+// Returns NULL if no aligned run of free pages exists.
+//
+struct PageInfo *
+page_alloc_large(int alloc_flags)
+{
+	struct CpuInfo *c = thiscpu;
+	struct PageInfo *pp, **link;
+	size_t base, i;
+
+	// Pages cached in the magazines would break up runs.
+	spin_lock(&magazine_locks[c - cpus]);
+	magazine_drain(c, c->cpu_npages);
+	spin_unlock(&magazine_locks[c - cpus]);
+	magazine_steal(c);
+
+	spin_lock(&page_lock);
+	for (base = 0; base + NPTENTRIES <= npages; base += NPTENTRIES) {
+		for (i = 0; i < NPTENTRIES; i++)
+			if (!(pages[base + i].pp_flags & PP_FREE))
+				break;
+		if (i == NPTENTRIES)
+			break;
+	}
+	if (base + NPTENTRIES > npages) {
+		spin_unlock(&page_lock);
+		return NULL;
+	}
+
+	pp = &pages[base];
+	for (link = &page_free_list; *link; )
+		if (*link >= pp && *link < pp + NPTENTRIES)
+			*link = (*link)->pp_link;
+		else
+			link = &(*link)->pp_link;
+	page_free_list_len -= NPTENTRIES;
+	spin_unlock(&page_lock);
+
+	for (i = 0; i < NPTENTRIES; i++) {
+		pp[i].pp_link = NULL;
+		pp[i].pp_flags = 0;
+	}
+	pp->pp_flags = PP_LARGE;
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PTSIZE);
+	return pp;
+}
+
 //
 // Initialize a Page structure.
 // The result has null links and 0 refcount.
@@ -509,30 +753,80 @@ page_initpp(struct PageInfo *pp)
 // Return a page to the free list.
 // (This function should only be called when pp->pp_ref reaches 0.)
 //
+// The page goes into this CPU's magazine; a full magazine is first
+// drained by half back to page_free_list.  The frames of a large page
+// go straight back to page_free_list so the run can be reused whole.
+//
 void
 page_free(struct PageInfo *pp)
 {
 #line 572 "../kern/pmap.c"
+	struct CpuInfo *c;
+	int i;
+
 	if (pp->pp_ref || pp->pp_link) {
 		warn("page_free: attempt to free mapped page");
 		return;		/* be conservative and assume page is still used */
 	}
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
-	pp->pp_ref = 0;
+	if (pp->pp_flags & PP_LARGE) {
+		pp->pp_flags = 0;
+		spin_lock(&page_lock);
+		for (i = NPTENTRIES - 1; i >= 0; i--)
+			page_free_list_push(pp + i);
+		spin_unlock(&page_lock);
+		return;
+	}
+	c = thiscpu;
+	spin_lock(&magazine_locks[c - cpus]);
+	if (c->cpu_npages == PAGE_MAGAZINE)
+		magazine_drain(c, PAGE_MAGAZINE / 2);
+	c->cpu_pages[c->cpu_npages++] = pp;
+	spin_unlock(&magazine_locks[c - cpus]);
 #line 584 "../kern/pmap.c"
 }
 
+//
+// Return the number of free physical pages, including those cached in
+// the per-CPU magazines and the zeroed pool.  Takes no locks, so it is
+// only a snapshot.
+//
+size_t
+page_free_count(void)
+{
+	size_t n = page_free_list_len + page_zero_list_len;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		n += cpus[i].cpu_npages;
+	return n;
+}
+
 //
 // Decrement the reference count on a page,
 // freeing it if there are no more refs.
+// Pages mapped by several environments can have their counts changed
+// by several CPUs at once, so mapping counts are updated atomically.
 //
 void
 page_decref(struct PageInfo* pp)
 {
-	if (--pp->pp_ref == 0)
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0)
 		page_free(pp);
 }
+// Allocate a zeroed page-table page and install it in 'slot'.
+// Returns its kernel virtual address, or NULL if out of memory.
+static void *
+pt_alloc(uint64_t *slot)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return NULL;
+	pp->pp_ref += 1;
+	*slot = page2pa(pp)|PTE_U|PTE_W|PTE_P;
+	return page2kva(pp);
+}
+
 // Given a pml4 pointer, pml4e_walk returns a pointer
 // to the page table entry (PTE) for linear address 'va'
 // This requires walking the 4-level page table structure
@@ -612,6 +906,8 @@ pdpe_walk(pdpe_t *pdpe,const void *va,int create){
 				}
 			}else
 				return NULL;
+		}else if((uint64_t)pdp & PTE_PS){
+			return (pte_t *)&pdpe[PDPE(va)];
 		}else if((uint64_t)pdp & PTE_P){
 			return pgdir_walk(KADDR((uintptr_t)((pde_t *)PTE_ADDR(pdp))),va,create);
 		}
@@ -621,6 +917,8 @@ pdpe_walk(pdpe_t *pdpe,const void *va,int create){
 }
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE). 
+// If 'va' is covered by a large page, the walkers return a pointer to
+// the PTE_PS entry itself (a pde_t or pdpe_t) instead.
 // The programming logic and the hints are the same as pml4e_walk
 // and pdpe_walk.
 
@@ -639,6 +937,8 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 			}else{
 				return NULL;
 			}
+		} else if ((uint64_t)pte & PTE_PS) {
+			return (pte_t *)&pgdir[PDX(va)];
 		} else if ((uint64_t)pte & PTE_P) {
 			return KADDR((uintptr_t)((pte_t *)PTE_ADDR(pte) + PTX(va)));
 		}
@@ -647,6 +947,63 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 #line 715 "../kern/pmap.c"
 }
 
+//
+// Return a pointer to the page directory entry for 'va', allocating
+// the intermediate tables if 'create' is set.  Returns NULL if they
+// are missing (or can't be allocated), or if 'va' lies in a 1GB page.
+//
+static pde_t *
+pde_walk(pml4e_t *pml4e, const void *va, int create)
+{
+	pdpe_t *pdpe;
+	pde_t *pgdir;
+
+	if (pml4e[PML4(va)] & PTE_P)
+		pdpe = KADDR(PTE_ADDR(pml4e[PML4(va)]));
+	else if (!create || !(pdpe = pt_alloc(&pml4e[PML4(va)])))
+		return NULL;
+	if (pdpe[PDPE(va)] & PTE_PS)
+		return NULL;
+	if (pdpe[PDPE(va)] & PTE_P)
+		pgdir = KADDR(PTE_ADDR(pdpe[PDPE(va)]));
+	else if (!create || !(pgdir = pt_alloc(&pdpe[PDPE(va)])))
+		return NULL;
+	return &pgdir[PDX(va)];
+}
+
+//
+// Return true if 'va' lies in a 2MB or 1GB page.  Only page directory
+// and PDPT entries have a page-size bit; in a 4K page's PTE the same
+// bit is PAT, so callers ask here rather than test PTE_PS on whatever
+// pml4e_walk returned.
+//
+bool
+page_is_large(pml4e_t *pml4e, const void *va)
+{
+	pdpe_t *pdpe;
+	pde_t *pgdir;
+
+	if (!(pml4e[PML4(va)] & PTE_P))
+		return false;
+	pdpe = KADDR(PTE_ADDR(pml4e[PML4(va)]));
+	if (!(pdpe[PDPE(va)] & PTE_P))
+		return false;
+	if (pdpe[PDPE(va)] & PTE_PS)
+		return true;
+	pgdir = KADDR(PTE_ADDR(pdpe[PDPE(va)]));
+	return (pgdir[PDX(va)] & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS);
+}
+
+// Does the CPU support 1GB pages?
+static bool
+has_1gb_pages(void)
+{
+	uint32_t edx;
+
+	cpuid(0x80000001, NULL, NULL, NULL, &edx);
+	return (edx & (1 << 26)) != 0;
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pml4e.  Size is a multiple of PGSIZE.
@@ -656,6 +1013,10 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
+// Whenever la, pa and the remaining size allow it and nothing is mapped
+// there yet, use a 1GB (if the CPU supports it) or 2MB PTE_PS entry
+// instead of a page table full of 4K entries.
+//
 // Hint: the TA solution uses pml4e_walk
 static void
 boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int perm)
@@ -664,10 +1025,35 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 	uint64_t i,j;
 	pdpe_t *pdpe;
 	pde_t *pde;
+	bool gbpages = has_1gb_pages();
 	//cprintf("mapping %x at %x (size: %x)\n", la, pa, size);
 	for (i = 0; i < size; i+=PGSIZE) {
-		pte_t *pte      = pml4e_walk(pml4e, (void *)(la + i), 1);
 		physaddr_t addr = pa + i;
+		if (gbpages && !((la + i) & (PDPESIZE - 1)) && !(addr & (PDPESIZE - 1))
+		    && size - i >= PDPESIZE) {
+			if (pml4e[PML4(la+i)] & PTE_P)
+				pdpe = KADDR(PTE_ADDR(pml4e[PML4(la+i)]));
+			else
+				pdpe = pt_alloc(&pml4e[PML4(la+i)]);
+			if (pdpe && !(pdpe[PDPE(la+i)] & PTE_P)) {
+				pdpe[PDPE(la+i)] = PTE_ADDR(addr)|perm|PTE_P|PTE_PS;
+				pml4e[PML4(la+i)] |= perm|PTE_P;
+				i += PDPESIZE - PGSIZE;
+				continue;
+			}
+		}
+		if (!((la + i) & (PTSIZE - 1)) && !(addr & (PTSIZE - 1))
+		    && size - i >= PTSIZE
+		    && (pde = pde_walk(pml4e, (void *)(la + i), 1))
+		    && !(*pde & PTE_P)) {
+			*pde = PTE_ADDR(addr)|perm|PTE_P|PTE_PS;
+			pml4e[PML4(la+i)] |= perm|PTE_P;
+			pdpe = (pdpe_t *)KADDR(PTE_ADDR(pml4e[PML4(la + i)]));
+			pdpe[PDPE(la+i)] |= perm|PTE_P;
+			i += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte_t *pte      = pml4e_walk(pml4e, (void *)(la + i), 1);
 		if (pte != NULL) {
 			*pte    = PTE_ADDR(addr)|perm|PTE_P;
 		}
@@ -701,6 +1087,8 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
+//   -E_INVAL, if va lies in a large page, which would have to be
+//     unmapped as a whole first
 //
 // Hint: The TA solution is implemented using pml4e_walk, page_remove,
 // and page2pa.
@@ -712,6 +1100,8 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 	pdpe_t *pdpe;
 	pde_t *pde;
 	if (pml4e && pp) {
+		if (page_is_large(pml4e, va))
+			return -E_INVAL;
 		pte_t *pte  = pml4e_walk(pml4e, va, 1);
 		if (pte != NULL) {
 			pml4e [PML4(va)] = pml4e [PML4(va)]|(perm&(~PTE_AVAIL));
@@ -726,7 +1116,7 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 			} else if (*pte & PTE_P) {
 				page_remove(pml4e, va);
 			}
-			pp->pp_ref  += 1;
+			__sync_fetch_and_add(&pp->pp_ref, 1);
 			*pte    = page2pa(pp)|perm|PTE_P;
 			tlb_invalidate(pml4e, va);
 			return 0;
@@ -737,6 +1127,43 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 #line 810 "../kern/pmap.c"
 }
 
+//
+// Map the large page 'pp' (from page_alloc_large) at the PTSIZE-aligned
+// address 'va' with a single PTE_PS page directory entry.  Anything
+// previously mapped in [va, va+PTSIZE) is removed, including the page
+// table that mapped it.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if the page directory couldn't be allocated
+//
+int
+page_insert_large(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
+{
+	pde_t *pde;
+	pte_t *pt;
+	int i;
+
+	assert(pp->pp_flags & PP_LARGE);
+	if (!(pde = pde_walk(pml4e, va, 1)))
+		return -E_NO_MEM;
+
+	// Take the reference first, in case 'pp' is already mapped here.
+	__sync_fetch_and_add(&pp->pp_ref, 1);
+	if (*pde & PTE_PS)
+		page_remove(pml4e, va);
+	else if (*pde & PTE_P) {
+		pt = KADDR(PTE_ADDR(*pde));
+		for (i = 0; i < NPTENTRIES; i++)
+			if (pt[i] & PTE_P)
+				page_remove(pml4e, (char *) va + i * PGSIZE);
+		page_decref(pa2page(PTE_ADDR(*pde)));
+	}
+	*pde = page2pa(pp)|perm|PTE_P|PTE_PS;
+	tlb_invalidate(pml4e, va);
+	return 0;
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -745,6 +1172,8 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// If va lies in a large page, the large page's head is returned and
+// *pte_store points at its PTE_PS entry.
 //
 // Hint: the TA solution uses pml4e_walk and pa2page.
 //
@@ -793,21 +1222,427 @@ page_remove(pml4e_t *pml4e, void *va)
 #line 871 "../kern/pmap.c"
 }
 
+// --------------------------------------------------------------
+// Process-context identifiers.
+//
+// Each environment gets a PCID in env_setup_vm, so env_run can load
+// its CR3 without flushing the TLB.  PCIDs are handed out in order,
+// and a freed PCID is only reused once pcid_next wraps around and
+// starts a new generation.  A CPU flushes its whole TLB the first
+// time it switches address spaces in a new generation, so nothing
+// cached for a recycled PCID survives.
+//
+// Since other CPUs keep their entries for a PCID when they switch
+// away from it, a change to an address space that is not loaded here
+// marks the PCID stale on every other CPU; they flush it the next time
+// they load it.  PCID 0 is the kernel's (boot_pml4e) and is always
+// flushed on load.  Allocation is protected by env_table_lock;
+// pcid_stale is updated by any CPU, so setting and clearing bits is
+// atomic: a plain store could drop another CPU's pending flush.
+// --------------------------------------------------------------
+
+#define NPCID	4096
+
+static bool pcid_enabled;		// CR4.PCIDE is set
+static bool invpcid_enabled;		// The CPU has INVPCID
+static uint64_t pcid_used[NPCID / 64];	// PCIDs not available to pcid_alloc
+static uint64_t pcid_dead[NPCID / 64];	// Freed, reusable next generation
+static int pcid_next = 1;
+static uint32_t pcid_gen;
+static uint32_t pcid_stale[NPCID];	// Bitmask of CPUs, per PCID
+
+// Enable PCIDs on this CPU if it supports them.
+void
+pcid_init_percpu(void)
+{
+	uint32_t maxleaf, ebx, ecx;
+
+	cpuid(0, &maxleaf, NULL, NULL, NULL);
+	cpuid(1, NULL, NULL, &ecx, NULL);
+	if (!(ecx & (1 << 17)))
+		return;
+	if (maxleaf >= 7) {
+		cpuid(7, NULL, &ebx, NULL, NULL);
+		invpcid_enabled = (ebx & (1 << 10)) != 0;
+	}
+	lcr4(rcr4() | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+// Allocate a PCID for a new address space, or 0 if PCIDs are off.
+int
+pcid_alloc(void)
+{
+	int pcid, i;
+
+	if (!pcid_enabled)
+		return 0;
+	for (;;) {
+		if (pcid_next == NPCID) {
+			for (i = 0; i < NPCID / 64; i++) {
+				pcid_used[i] &= ~pcid_dead[i];
+				pcid_dead[i] = 0;
+			}
+			pcid_next = 1;
+			pcid_gen++;
+		}
+		pcid = pcid_next++;
+		if (!(pcid_used[pcid / 64] & (1ULL << (pcid % 64))))
+			break;
+	}
+	pcid_used[pcid / 64] |= 1ULL << (pcid % 64);
+	pcid_stale[pcid] = 0;
+	return pcid;
+}
+
+// Release 'pcid'.  Until the next generation its TLB entries may
+// still be cached, so it stays unavailable until then.
+void
+pcid_free(int pcid)
+{
+	if (pcid)
+		pcid_dead[pcid / 64] |= 1ULL << (pcid % 64);
+}
+
+// Flush every TLB entry on this CPU, for all PCIDs.
+static void
+tlb_flush_cpu(void)
+{
+	uint64_t cr4;
+
+	if (invpcid_enabled)
+		invpcid(INVPCID_ALL, 0, 0);
+	else {
+		// Toggling CR4.PGE flushes all PCIDs.
+		cr4 = rcr4();
+		lcr4(cr4 ^ CR4_PGE);
+		lcr4(cr4);
+	}
+}
+
+// Load the page table 'cr3' tagged with 'pcid', keeping whatever this
+// CPU still has cached for that PCID unless it may be stale.
+void
+pcid_lcr3(physaddr_t cr3, int pcid)
+{
+	struct CpuInfo *c = thiscpu;
+	uint32_t me = 1 << cpunum();
+
+	if (!pcid_enabled || !pcid) {
+		lcr3(cr3);
+		return;
+	}
+	if (c->cpu_pcid_gen != pcid_gen) {
+		tlb_flush_cpu();
+		c->cpu_pcid_gen = pcid_gen;
+	}
+	if (pcid_stale[pcid] & me) {
+		__sync_fetch_and_and(&pcid_stale[pcid], ~me);
+		lcr3(cr3 | pcid);
+	} else
+		lcr3(cr3 | pcid | CR3_NOFLUSH);
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// With PCIDs, other CPUs (and this one, if the address space isn't
+// loaded and INVPCID is missing) flush the PCID when they next load it.
 //
 void
 tlb_invalidate(pml4e_t *pml4e, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
 #line 882 "../kern/pmap.c"
+	int pcid;
+	uint32_t me;
+
 	assert(pml4e!=NULL);
-	if (!curenv || curenv->env_pml4e == pml4e)
+	if (!pcid_enabled) {
+		if (!curenv || curenv->env_pml4e == pml4e)
+			invlpg(va);
+		return;
+	}
+	// Between env_run's lcr3 and curenv being set (or after the env
+	// exits) curenv says nothing about CR3, so ask CR3 itself.
+	pcid = pa2page(PADDR(pml4e))->pp_pcid;
+	me = 1 << cpunum();
+	__sync_fetch_and_or(&pcid_stale[pcid], ~me);
+	if (PTE_ADDR(rcr3()) == PADDR(pml4e))
 		invlpg(va);
+	else if (invpcid_enabled)
+		invpcid(INVPCID_ADDR, pcid, (uintptr_t) va);
+	else
+		__sync_fetch_and_or(&pcid_stale[pcid], me);
 #line 889 "../kern/pmap.c"
 }
 
+//
+// Invalidate all TLB entries for the address space 'pml4e', on every
+// CPU.
+//
+void
+tlb_flush(pml4e_t *pml4e)
+{
+	int pcid = pa2page(PADDR(pml4e))->pp_pcid;
+
+	__sync_fetch_and_or(&pcid_stale[pcid], ~0);
+	if (PTE_ADDR(rcr3()) == PADDR(pml4e))
+		pcid_lcr3(PADDR(pml4e), pcid);
+}
+
+//
+// Resolve a write fault on the copy-on-write page at 'va'.
+// If no one else maps the page any more, just make the PTE writable
+// again; otherwise map a private copy in its place.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is not a read-only PTE_COW user page
+//   -E_NO_MEM, if the copy couldn't be allocated
+//
+int
+page_cow_fault(pml4e_t *pml4e, void *va)
+{
+	pte_t *pte;
+	struct PageInfo *pp, *np;
+	bool large;
+
+	if (!(pp = page_lookup(pml4e, va, &pte)))
+		return -E_INVAL;
+	if ((*pte & (PTE_U|PTE_W|PTE_COW)) != (PTE_U|PTE_COW))
+		return -E_INVAL;
+	large = page_is_large(pml4e, va);
+	va = ROUNDDOWN(va, large ? PTSIZE : PGSIZE);
+
+	if (pp->pp_ref == 1)
+		*pte = (*pte & ~PTE_COW) | PTE_W;
+	else {
+		if (!(np = large ? page_alloc_large(0) : page_alloc(0)))
+			return -E_NO_MEM;
+		memcpy(page2kva(np), page2kva(pp), large ? PTSIZE : PGSIZE);
+		np->pp_ref += 1;
+		*pte = page2pa(np) | (*pte & (PTE_SYSCALL|PTE_PS) & ~PTE_COW) | PTE_W;
+		page_decref(pp);
+	}
+	tlb_invalidate(pml4e, va);
+	return 0;
+}
+
+//
+// Resolve the first touch of a page in one of env's demand-zero regions
+// (see sys_region_reserve) by mapping a zeroed page at 'va'.
+// The caller must hold env's lock.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is already mapped or in none of env's regions
+//   -E_NO_MEM, if the page or a page table couldn't be allocated
+//
+int
+page_zero_fault(struct Env *env, void *va)
+{
+	struct EnvRegion *er;
+	struct PageInfo *pp;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	for (er = env->env_regions; er < env->env_regions + ENV_NREGION; er++)
+		if ((uintptr_t) va >= er->er_start && (uintptr_t) va < er->er_end)
+			break;
+	if (er == env->env_regions + ENV_NREGION)
+		return -E_INVAL;
+	if (page_lookup(env->env_pml4e, va, 0))
+		return -E_INVAL;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if ((r = page_insert(env->env_pml4e, pp, va, er->er_perm)) < 0)
+		page_free(pp);
+	return r;
+}
+
+//
+// Clone the user half of 'src' (everything below PML4 slot 1) into the
+// freshly set up address space 'dst', for fork.
+// Read-only and PTE_SHARE pages are mapped into 'dst' as they are.
+// Writable and copy-on-write pages become read-only PTE_COW mappings in
+// both address spaces.  The user exception stack is skipped; the child
+// needs a private one.
+//
+// Each level of the page table is visited once, rather than calling
+// pml4e_walk for every page, and if 'src' is the current address space
+// the TLB is flushed once at the end instead of page by page.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated.  'dst' is left
+//   partially filled in and should be freed with env_free.
+//
+int
+pml4e_fork(pml4e_t *dst, pml4e_t *src)
+{
+	pdpe_t *spdpe, *dpdpe;
+	pde_t *spgdir, *dpgdir;
+	pte_t *spt, *dpt, pte;
+	uint64_t i, j, k;
+	uintptr_t va;
+	int r = 0;
+
+	if (!(src[0] & PTE_P))
+		return 0;
+	spdpe = KADDR(PTE_ADDR(src[0]));
+	if (!(dpdpe = pt_alloc(&dst[0])))
+		return -E_NO_MEM;
+
+	for (i = 0; i < NPDPENTRIES; i++) {
+		if (!(spdpe[i] & PTE_P))
+			continue;
+		spgdir = KADDR(PTE_ADDR(spdpe[i]));
+		if (!(dpgdir = pt_alloc(&dpdpe[i]))) {
+			r = -E_NO_MEM;
+			goto out;
+		}
+		for (j = 0; j < NPDENTRIES; j++) {
+			if (!(spgdir[j] & PTE_P))
+				continue;
+			if (spgdir[j] & PTE_PS) {
+				// A large page is shared or marked COW as a whole.
+				pte = spgdir[j];
+				if (!(pte & PTE_U))
+					continue;
+				if ((pte & (PTE_W|PTE_COW)) && !(pte & PTE_SHARE)) {
+					pte = (pte & ~PTE_W) | PTE_COW;
+					spgdir[j] = pte;
+				}
+				dpgdir[j] = PTE_ADDR(pte) | (pte & (PTE_SYSCALL|PTE_PS));
+				__sync_fetch_and_add(&pa2page(PTE_ADDR(pte))->pp_ref, 1);
+				continue;
+			}
+			spt = KADDR(PTE_ADDR(spgdir[j]));
+			if (!(dpt = pt_alloc(&dpgdir[j]))) {
+				r = -E_NO_MEM;
+				goto out;
+			}
+			for (k = 0; k < NPTENTRIES; k++) {
+				pte = spt[k];
+				if ((pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+					continue;
+				va = (i << PDPESHIFT) | (j << PDXSHIFT) | (k << PTXSHIFT);
+				if (va == UXSTACKTOP - PGSIZE)
+					continue;
+				if ((pte & (PTE_W|PTE_COW)) && !(pte & PTE_SHARE)) {
+					pte = (pte & ~PTE_W) | PTE_COW;
+					spt[k] = pte;
+				}
+				dpt[k] = PTE_ADDR(pte) | (pte & PTE_SYSCALL);
+				__sync_fetch_and_add(&pa2page(PTE_ADDR(pte))->pp_ref, 1);
+			}
+		}
+	}
+
+out:
+	tlb_flush(src);
+	return r;
+}
+
+// Page-table pages of torn-down address spaces, linked through pp_link,
+// waiting for pt_reap.  Protected by page_lock.
+static struct PageInfo *pt_dead_list;
+
+// Drop the reference that the table entry 'e' holds on a page-table
+// page, and put the page on 'dead' if it was the last one.
+static void
+pt_dead(struct PageInfo **dead, uint64_t e)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(e));
+
+	if (__sync_sub_and_fetch(&pp->pp_ref, 1) == 0) {
+		pp->pp_link = *dead;
+		*dead = pp;
+	}
+}
+
+//
+// Unmap everything in the user half of 'pml4e' (PML4 slot 0), for
+// env_free, in a single pass over its page tables.  Unlike page_remove,
+// this neither walks the tables again for every page nor invalidates
+// TLB entries one page at a time: the address space is never loaded
+// again, and its PCID is not reused until a new generation flushes
+// every TLB (see pcid_alloc).
+//
+// The page-table pages go on pt_dead_list instead of being freed, so
+// that an idle CPU pays for freeing them (see pt_reap).
+//
+void
+pml4e_teardown(pml4e_t *pml4e)
+{
+	pdpe_t *pdpe;
+	pde_t *pgdir;
+	pte_t *pt;
+	struct PageInfo *dead = NULL, *last;
+	uint64_t i, j, k;
+
+	if (!(pml4e[0] & PTE_P))
+		return;
+	pdpe = KADDR(PTE_ADDR(pml4e[0]));
+	for (i = 0; i < NPDPENTRIES; i++) {
+		if (!(pdpe[i] & PTE_P))
+			continue;
+		pgdir = KADDR(PTE_ADDR(pdpe[i]));
+		for (j = 0; j < NPDENTRIES; j++) {
+			if (!(pgdir[j] & PTE_P))
+				continue;
+			// A large page has no page table to free.
+			if (pgdir[j] & PTE_PS) {
+				page_decref(pa2page(PTE_ADDR(pgdir[j])));
+				continue;
+			}
+			pt = KADDR(PTE_ADDR(pgdir[j]));
+			for (k = 0; k < NPTENTRIES; k++)
+				if (pt[k] & PTE_P)
+					page_decref(pa2page(PTE_ADDR(pt[k])));
+			pt_dead(&dead, pgdir[j]);
+		}
+		pt_dead(&dead, pdpe[i]);
+	}
+	pt_dead(&dead, pml4e[0]);
+	pml4e[0] = 0;
+
+	if (!dead)
+		return;
+	for (last = dead; last->pp_link; last = last->pp_link)
+		;
+	spin_lock(&page_lock);
+	last->pp_link = pt_dead_list;
+	pt_dead_list = dead;
+	spin_unlock(&page_lock);
+}
+
+//
+// Free up to 'n' page-table pages left by pml4e_teardown.  Called by
+// idle CPUs from sched_halt, and by page_alloc when it runs out.
+// Returns the number of pages freed.
+//
+int
+pt_reap(int n)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < n && pt_dead_list; i++) {
+		spin_lock(&page_lock);
+		if ((pp = pt_dead_list)) {
+			pt_dead_list = pp->pp_link;
+			pp->pp_link = NULL;
+		}
+		spin_unlock(&page_lock);
+		if (!pp)
+			break;
+		page_free(pp);
+	}
+	return i;
+}
+
 #line 892 "../kern/pmap.c"
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
@@ -871,6 +1706,10 @@ static uintptr_t user_mem_check_addr;
 // If there is an error, set the 'user_mem_check_addr' variable to the first
 // erroneous virtual address.
 //
+// A write to a copy-on-write page is allowed: if 'perm' includes PTE_W,
+// such pages are copied first, just as a user write would, so the
+// caller must hold env's lock.
+//
 // Returns 0 if the user program can access this range of addresses,
 // and -E_FAULT otherwise.
 //
@@ -886,11 +1725,13 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	}
 	while(va<endva){
 		ptep = pml4e_walk(env->env_pml4e,va,0);
+		if (ptep && (perm & PTE_W) && (*ptep & PTE_COW))
+			page_cow_fault(env->env_pml4e, (void *) va);
 		if (!ptep || (*ptep & (perm | PTE_P)) != (perm | PTE_P)) {
 			user_mem_check_addr = (uintptr_t) va;
 			return -E_FAULT;
 		}
-		va = ROUNDUP(va+1,PGSIZE);
+		va = ROUNDUP(va+1, page_is_large(env->env_pml4e, va) ? PTSIZE : PGSIZE);
 	}
 #line 981 "../kern/pmap.c"
 	return 0;
@@ -907,13 +1748,52 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
+	int r;
+
+	env_lock(env);
+	r = user_mem_check(env, va, len, perm | PTE_U);
+	env_unlock(env);
+	if (r < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
 		env_destroy(env);	// may not return
 	}
 }
 
+//
+// Like user_mem_assert for the current environment 'env', but returns
+// with env's lock held, so that [va, va+len) stays mapped while the
+// kernel reads or writes it.  The caller must env_unlock(env).
+//
+void
+user_mem_lock(struct Env *env, const void *va, size_t len, int perm)
+{
+	uintptr_t p, end = (uintptr_t) va + len;
+	bool filled;
+
+	assert(env == curenv);
+	for (;;) {
+		env_lock(env);
+		if (user_mem_check(env, va, len, perm | PTE_U) >= 0)
+			return;
+		// user_mem_check has already copied any copy-on-write
+		// pages, including region pages a fork shared.  What's
+		// left may be demand-zero pages that haven't been touched
+		// yet; fill them in as user accesses would, up to the
+		// first page that is neither mapped nor reserved.
+		filled = 0;
+		for (p = ROUNDDOWN((uintptr_t) va, PGSIZE);
+		     p < end && end <= UTOP; p += PGSIZE)
+			if (page_zero_fault(env, (void *) p) == 0)
+				filled = 1;
+			else if (!page_lookup(env->env_pml4e, (void *) p, 0))
+				break;
+		env_unlock(env);
+		if (!filled)
+			user_mem_assert(env, va, len, perm);
+	}
+}
+
 #line 1003 "../kern/pmap.c"
 
 // --------------------------------------------------------------
@@ -1094,6 +1974,7 @@ check_boot_pml4e(pml4e_t *pml4e)
 	n = ROUNDUP(NENV*sizeof(struct Env), PGSIZE);
 	for (i = 0; i < n; i += PGSIZE)
 		assert(check_va2pa(pml4e, UENVS + i) == PADDR(envs) + i);
+	assert(check_va2pa(pml4e, UTIME) == PADDR(timepage));
 #line 1183 "../kern/pmap.c"
 
 	// check phys mem
@@ -1159,11 +2040,15 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va)
 	// cprintf(" %x %x " , pdpe, *pdpe);
 	if (!(pdpe[PDPE(va)] & PTE_P))
 		return ~0;
+	if (pdpe[PDPE(va)] & PTE_PS)
+		return PTE_ADDR(pdpe[PDPE(va)]) + (va & (PDPESIZE - 1) & ~(PGSIZE - 1));
 	pde = (pde_t *) KADDR(PTE_ADDR(pdpe[PDPE(va)]));
 	// cprintf(" %x %x " , pde, *pde);
 	pde = &pde[PDX(va)];
 	if (!(*pde & PTE_P))
 		return ~0;
+	if (*pde & PTE_PS)
+		return PTE_ADDR(*pde) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	pte = (pte_t*) KADDR(PTE_ADDR(*pde));
 	// cprintf(" %x %x " , pte, *pte);
 	if (!(pte[PTX(va)] & PTE_P))
@@ -55,13 +55,30 @@ void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
+struct PageInfo * page_alloc_large(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+size_t	page_free_count(void);
+void	page_zero_fill(int n);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
+bool	page_is_large(pml4e_t *pml4e, const void *va);
+int	page_insert_large(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
+void	tlb_flush(pml4e_t *pml4e);
+
+void	pcid_init_percpu(void);
+int	pcid_alloc(void);
+void	pcid_free(int pcid);
+void	pcid_lcr3(physaddr_t cr3, int pcid);
+
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
+int	page_cow_fault(pml4e_t *pml4e, void *va);
+int	page_zero_fault(struct Env *env, void *va);
+int	pml4e_fork(pml4e_t *dst, pml4e_t *src);
+void	pml4e_teardown(pml4e_t *pml4e);
+int	pt_reap(int n);
 
 #line 67 "../kern/pmap.h"
 void *	mmio_map_region(physaddr_t pa, size_t size);
@@ -69,6 +86,7 @@ void *	mmio_map_region(physaddr_t pa, size_t size);
 #line 71 "../kern/pmap.h"
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+void	user_mem_lock(struct Env *env, const void *va, size_t len, int perm);
 
 #line 75 "../kern/pmap.h"
 static inline ppn_t
@@ -5,6 +5,9 @@
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
+#include <kern/console.h>
+
+extern const char *panicstr;
 
 
 static void
@@ -19,9 +22,17 @@ vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
 	va_list aq;
+	// Once the kernel has panicked, the lock's holder may never
+	// release it, so just print.
+	bool locked = !panicstr;
+
+	if (locked)
+		spin_lock(&console_lock);
 	va_copy(aq,ap);
 	vprintfmt((void*)putch, &cnt, fmt, aq);
 	va_end(aq);
+	if (locked)
+		spin_unlock(&console_lock);
 	return cnt;
 
 }
@@ -5,6 +5,7 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/time.h>
 void sched_halt(void);
 
 
@@ -27,40 +28,132 @@ vmxon() {
 #endif
 #line 30 "../kern/sched.c"
 
+// Runnable environments are tracked in a two-level bitmap indexed by
+// ENVX: bit i of runq_map[w] is set iff envs[w*64 + i] is ENV_RUNNABLE,
+// and bit w of runq_summary is set iff runq_map[w] is non-zero.
+// Picking the next environment is then a couple of bsf instructions
+// rather than a walk over all of envs[].  Everything here is protected
+// by env_table_lock.
+#define RUNQ_WORDS	(NENV / 64)
+static uint64_t runq_map[RUNQ_WORDS];
+static uint64_t runq_summary;
+
+// Number of environments that are ENV_RUNNABLE, ENV_RUNNING or
+// ENV_DYING, so sched_halt can tell cheaply whether anything is alive.
+static int sched_nactive;
+
+// Pages an idle CPU zeroes for page_alloc each time it halts.  Small
+// enough that a halting CPU still answers interrupts promptly.
+#define PAGE_ZERO_IDLE	64
+
+// Page-table pages of dead environments an idle CPU frees each time it
+// halts (see pml4e_teardown).
+#define PT_REAP_IDLE	256
+
+static bool
+env_status_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING ||
+		status == ENV_DYING;
+}
+
+// Wake one CPU halted in sched_halt, if there is one, so that it runs
+// an environment that just became runnable instead of noticing it only
+// at its next timer interrupt.  Claiming the CPU with a compare-and-
+// swap makes sure each halt gets at most one IPI.  A CPU that sets
+// CPU_HALTED but hasn't reached hlt yet takes the IPI right after its
+// sti, so the wakeup isn't lost.
+static void
+sched_kick_idle(void)
+{
+#ifndef VMM_GUEST
+	struct CpuInfo *c;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu &&
+		    __sync_bool_compare_and_swap(&c->cpu_status,
+						 CPU_HALTED, CPU_STARTED)) {
+			lapic_ipi_cpu(c->cpu_id, T_RESCHED);
+			return;
+		}
+#endif
+}
+
+// Called by env_set_status after e->env_status changed from 'old'.
+void
+sched_status_changed(struct Env *e, unsigned old)
+{
+	int i = e - envs;
+
+	static_assert(RUNQ_WORDS <= 64);
+
+	if (e->env_status == ENV_RUNNABLE) {
+		runq_map[i >> 6] |= 1ULL << (i & 63);
+		runq_summary |= 1ULL << (i >> 6);
+	} else if (old == ENV_RUNNABLE) {
+		runq_map[i >> 6] &= ~(1ULL << (i & 63));
+		if (!runq_map[i >> 6])
+			runq_summary &= ~(1ULL << (i >> 6));
+	}
+
+	sched_nactive += env_status_active(e->env_status) -
+		env_status_active(old);
+
+	// New work, as opposed to this CPU's environment yielding.
+	if (e->env_status == ENV_RUNNABLE && old != ENV_RUNNABLE &&
+	    old != ENV_RUNNING)
+		sched_kick_idle();
+}
+
+// Return the index of the first runnable environment at or after
+// envs[start], or -1 if there is none.
+static int
+runq_next(int start)
+{
+	int w = start >> 6;
+	uint64_t bits;
+
+	if (w < RUNQ_WORDS) {
+		bits = runq_map[w] & (~0ULL << (start & 63));
+		if (bits)
+			return (w << 6) + bsf(bits);
+		w++;
+	}
+	if (w >= RUNQ_WORDS)
+		return -1;
+	bits = runq_summary & (~0ULL << w);
+	if (!bits)
+		return -1;
+	w = bsf(bits);
+	return (w << 6) + bsf(runq_map[w]);
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-	int i, j, k;
+	int i, k;
 
-	// Determine the starting point for the search.
-	if (curenv)
-		i = curenv-envs;
-	else
-		i = NENV-1;
-	//cprintf("sched_yield searching from %d\n", i);
+	spin_lock(&env_table_lock);
 
-	int r;
-	// Loop through all the environments at most once.
-	for (j = 1; j <= NENV; j++) {
-		k = (j + i) % NENV;
-		// If this environment is runnable, run it.
-		if (envs[k].env_status == ENV_RUNNABLE) {
-            /* Your code here */
-            if(envs[k].env_type == ENV_TYPE_GUEST){
-				//cprintf("[DEBUG] Attempting to start the guest VM...\n");
-                #ifndef VMM_GUEST
-                vmxon();
-                // r = vmxon();
-                // if (r < 0) {
-                //     env_destroy(&envs[k]);
-                //     continue;
-                // }
-                #endif
-            }
-            env_run(&envs[k]);
+	// An environment destroyed while it ran on this CPU is ours to free.
+	if (curenv && curenv->env_status == ENV_DYING) {
+		spin_unlock(&env_table_lock);
+		env_destroy(curenv);
+	}
+
+	// Search round-robin, starting just after the current environment.
+	i = curenv ? curenv - envs + 1 : 0;
+	if ((k = runq_next(i)) < 0)
+		k = runq_next(0);
+
+	if (k >= 0) {
+		if (envs[k].env_type == ENV_TYPE_GUEST) {
+#ifndef VMM_GUEST
+			vmxon();
+#endif
 		}
+		env_run(&envs[k]);
 	}
 
 	if (curenv && curenv->env_status == ENV_RUNNING) {
@@ -75,6 +168,7 @@ sched_yield(void)
                 // }
 			#endif
         }
+        spin_unlock(&env_table_lock);
         env_run(curenv);
 	}
 
@@ -86,21 +180,19 @@ sched_yield(void)
 
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
+// Called with env_table_lock held.
 //
 void
 sched_halt(void)
 {
-	int i;
-
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
-			break;
-	}
-	if (i == NENV) {
+	// Only the boot CPU does, so the monitor has the console to itself.
+	// While a timer is pending, an environment sleeping on it will
+	// wake, and the boot CPU's clock interrupt is what fires it, so
+	// halt instead.
+	if (sched_nactive == 0 && thiscpu == bootcpu && !timer_pending()) {
+		spin_unlock(&env_table_lock);
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -110,13 +202,19 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(boot_pml4e));
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state, so that trap() knows
+	// it was woken up from here.
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	spin_unlock(&env_table_lock);
+
+	// Use the idle time to free dead page tables, then to top up the
+	// pool of zeroed pages.
+	pt_reap(PT_REAP_IDLE);
+	page_zero_fill(PAGE_ZERO_IDLE);
+
+	// trap() adds the time until the next interrupt to cpu_idle_tsc.
+	thiscpu->cpu_halt_tsc = read_tsc();
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -10,4 +10,7 @@
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+struct Env;
+void sched_status_changed(struct Env *e, unsigned old);
+
 #endif	// !JOS_KERN_SCHED_H
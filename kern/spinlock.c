@@ -10,13 +10,6 @@
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
 
-// The big kernel lock
-struct spinlock kernel_lock = {
-#ifdef DEBUG_SPINLOCK
-	.name = "kernel_lock"
-#endif
-};
-
 #ifdef DEBUG_SPINLOCK
 // Record the current call stack in pcs[] by following the %ebp chain.
 static void
@@ -40,18 +33,15 @@ get_caller_pcs(uint64_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-	return lock->locked && lock->cpu == thiscpu;
+	return lock->next != lock->owner && lock->cpu == thiscpu;
 }
 #endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-	lk->locked = 0;
-#ifdef DEBUG_SPINLOCK
+	memset(lk, 0, sizeof(*lk));
 	lk->name = name;
-	lk->cpu = 0;
-#endif
 }
 
 // Acquire the lock.
@@ -66,11 +56,24 @@ spin_lock(struct spinlock *lk)
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-	// The xchg is atomic.
+	uint32_t ticket;
+	uint64_t spins = 0;
+
+	// The locked xadd is atomic.
 	// It also serializes, so that reads after acquire are not
-	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// reordered before it.
+	ticket = __sync_fetch_and_add(&lk->next, 1);
+	while (lk->owner != ticket) {
 		asm volatile ("pause");
+		spins++;
+	}
+
+	lk->acquired = read_tsc();
+	lk->nacquire++;
+	if (spins) {
+		lk->ncontend++;
+		lk->nspin += spins;
+	}
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
@@ -83,10 +86,12 @@ spin_lock(struct spinlock *lk)
 void
 spin_unlock(struct spinlock *lk)
 {
+	uint64_t hold;
+
 #ifdef DEBUG_SPINLOCK
 	if (!holding(lk)) {
 		int i;
-		uint32_t pcs[10];
+		uintptr_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
 		memmove(pcs, lk->pcs, sizeof pcs);
 		if (!lk->cpu) 
@@ -112,14 +117,82 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-	// The xchg serializes, so that reads before release are 
-	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
-	// 7.2) says reads can be carried out speculatively and in
-	// any order, which implies we need to serialize here.
-	// But the 2007 Intel 64 Architecture Memory Ordering White
-	// Paper says that Intel 64 and IA-32 will not move a load
-	// after a store. So lock->locked = 0 would work here.
-	// The xchg being asm volatile ensures gcc emits it after
-	// the above assignments (and after the critical section).
-	xchg(&lk->locked, 0);
+	hold = read_tsc() - lk->acquired;
+	if (hold > lk->maxhold)
+		lk->maxhold = hold;
+
+	// The 2007 Intel 64 Architecture Memory Ordering White Paper
+	// says that Intel 64 and IA-32 will not move a load or a store
+	// after a store, so a plain store releases the lock.  Only the
+	// holder writes 'owner'.  The compiler barrier keeps gcc from
+	// sinking the critical section below it.
+	asm volatile("" ::: "memory");
+	lk->owner = lk->owner + 1;
+}
+
+// --------------------------------------------------------------
+// Contention statistics.
+// --------------------------------------------------------------
+
+// Locks the monitor's lockstat command reports on.  An entry may be
+// an array of locks, reported as one.  Registered during boot, before
+// other CPUs start.
+#define NLOCKSTAT	16
+static struct {
+	struct spinlock *lks;
+	int n;
+} lockstats[NLOCKSTAT];
+static int nlockstats;
+
+// Report the 'n' locks starting at 'lks' in spin_print_stats.
+void
+spin_register(struct spinlock *lks, int n)
+{
+	if (nlockstats == NLOCKSTAT)
+		panic("spin_register: too many locks");
+	lockstats[nlockstats].lks = lks;
+	lockstats[nlockstats].n = n;
+	nlockstats++;
+}
+
+// Print the contention statistics of every registered lock.
+// The numbers are read without the locks, so they are approximate
+// while other CPUs are running.
+void
+spin_print_stats(void)
+{
+	uint64_t nacquire, ncontend, nspin, maxhold;
+	struct spinlock *lk;
+	int i, j;
+
+	cprintf("%-16s %12s %12s %14s %12s\n", "lock", "acquire",
+		"contended", "spins", "max hold");
+	for (i = 0; i < nlockstats; i++) {
+		nacquire = ncontend = nspin = maxhold = 0;
+		for (j = 0; j < lockstats[i].n; j++) {
+			lk = &lockstats[i].lks[j];
+			nacquire += lk->nacquire;
+			ncontend += lk->ncontend;
+			nspin += lk->nspin;
+			maxhold = MAX(maxhold, lk->maxhold);
+		}
+		cprintf("%-16s %12lu %12lu %14lu %12lu\n",
+			lockstats[i].lks[0].name, nacquire, ncontend,
+			nspin, maxhold);
+	}
+}
+
+// Zero the contention statistics of every registered lock.
+void
+spin_reset_stats(void)
+{
+	struct spinlock *lk;
+	int i, j;
+
+	for (i = 0; i < nlockstats; i++)
+		for (j = 0; j < lockstats[i].n; j++) {
+			lk = &lockstats[i].lks[j];
+			lk->nacquire = lk->ncontend = lk->nspin = 0;
+			lk->maxhold = 0;
+		}
 }
@@ -4,16 +4,27 @@
 
 #include <inc/types.h>
 
-// Comment this to disable spinlock debugging
-#define DEBUG_SPINLOCK
+// Build with 'make DEBUG_SPINLOCK=1' to record which CPU holds each
+// lock and where it was acquired, and to catch recursive acquires
+// and releases of locks this CPU doesn't hold.
 
-// Mutual exclusion lock.
+// Mutual exclusion lock.  A ticket lock: each CPU takes the next
+// ticket and waits for 'owner' to reach it, so waiters get the lock
+// in arrival order.
 struct spinlock {
-	unsigned locked;       // Is the lock held?
+	volatile uint32_t next;   // Next ticket to hand out.
+	volatile uint32_t owner;  // Ticket of the current holder.
+	char *name;            // Name of lock.
+
+	// Contention statistics, only written by the holder.
+	uint64_t nacquire;     // Number of acquisitions.
+	uint64_t ncontend;     // Acquisitions that had to wait.
+	uint64_t nspin;        // Total spin iterations while waiting.
+	uint64_t maxhold;      // Longest hold, in TSC cycles.
+	uint64_t acquired;     // TSC at the last acquisition.
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
-	char *name;            // Name of lock.
 	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
@@ -24,26 +35,10 @@ void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
 
-#define spin_initlock(lock)   __spin_initlock(lock, #lock)
+void spin_register(struct spinlock *lks, int n);
+void spin_print_stats(void);
+void spin_reset_stats(void);
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+#define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
 #endif
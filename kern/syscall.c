@@ -16,6 +16,8 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 #include <kern/e1000.h>
 #ifndef VMM_GUEST
 #include <vmm/ept.h>
@@ -32,10 +34,11 @@ sys_cputs(const char *s, size_t len)
     // Destroy the environment if not.
 
     // LAB 3: Your code here.
-    user_mem_assert(curenv, s, len, PTE_U);
+    user_mem_lock(curenv, s, len, PTE_U);
 
     // Print the string supplied by the user.
     cprintf("%.*s", len, s);
+    env_unlock(curenv);
 }
 
 // Read a character from the system console without blocking.
@@ -66,8 +69,54 @@ sys_env_destroy(envid_t envid)
 
     if ((r = envid2env(envid, &e, 1)) < 0)
         return r;
-    env_destroy(e);
-    return 0;
+    // Destroying yourself is exiting; anyone else is killed.
+    if (e == curenv)
+        e->env_exit_status = 0;
+    return env_destroy_checked(e, envid);
+}
+
+// Destroy the current environment, leaving 'status' for a parent
+// blocked in sys_env_wait.
+static void
+sys_env_exit(int status)
+{
+    curenv->env_exit_status = status;
+    env_destroy(curenv);
+}
+
+// Block until child 'envid' has exited, then record its exit status in
+// curenv->env_child_status.  A child that exited before the call is
+// found as long as its envs[] slot has not been reused.
+//
+// Returns 0 once the child has exited (the system call returns it when
+// curenv runs again), or < 0 on error.  Errors are:
+//	-E_BAD_ENV if envid is not a child of curenv, or its slot has
+//		been reused.
+//	-E_AGAIN if curenv was made runnable before the child exited.
+static int
+sys_env_wait(envid_t envid)
+{
+    struct Env *self = curenv;
+    struct Env *e = &envs[ENVX(envid)];
+    int r = 0;
+
+    spin_lock(&env_table_lock);
+    if (envid <= 0 || e->env_id != envid || e->env_parent_id != self->env_id)
+        r = -E_BAD_ENV;
+    else if (e->env_status == ENV_FREE)
+        self->env_child_status = e->env_exit_status;
+    else {
+        // env_free delivers the exit status and makes us runnable.
+        self->env_tf.tf_regs.reg_rax = -E_AGAIN;
+        self->env_wait_for = envid;
+        env_set_status_locked(self, ENV_NOT_RUNNABLE);
+        if (self->env_status == ENV_NOT_RUNNABLE)
+            self->env_sleep = ENV_SLEEP_CHILD;
+        spin_unlock(&env_table_lock);
+        sched_yield();
+    }
+    spin_unlock(&env_table_lock);
+    return r;
 }
 
 // Deschedule current environment and pick a different one to run.
@@ -89,12 +138,54 @@ sys_exofork(void)
 
     if ((r = env_alloc(&e, curenv->env_id)) < 0)
         return r;
-    e->env_status = ENV_NOT_RUNNABLE;
     e->env_tf = curenv->env_tf;
     e->env_tf.tf_regs.reg_rax = 0;
     return e->env_id;
 }
 
+// Fork the current environment with copy-on-write in a single call.
+// The child gets a copy-on-write clone of the parent's address space
+// (see pml4e_fork), a fresh exception stack, and the parent's page
+// fault upcall, and is marked runnable.  It resumes with rax == 0.
+// Returns envid of the child, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork(void)
+{
+    int r;
+    struct Env *e;
+    struct PageInfo *pp;
+
+    if ((r = env_alloc(&e, curenv->env_id)) < 0)
+        return r;
+    e->env_tf = curenv->env_tf;
+    e->env_tf.tf_regs.reg_rax = 0;
+    e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+    env_lock_pair(curenv, e);
+    if ((r = pml4e_fork(e->env_pml4e, curenv->env_pml4e)) < 0)
+        goto bad;
+    memmove(e->env_regions, curenv->env_regions, sizeof(e->env_regions));
+    r = -E_NO_MEM;
+    if (!(pp = page_alloc(ALLOC_ZERO)))
+        goto bad;
+    if ((r = page_insert(e->env_pml4e, pp, (void *)(UXSTACKTOP - PGSIZE),
+                         PTE_P | PTE_U | PTE_W)) < 0) {
+        page_free(pp);
+        goto bad;
+    }
+    env_unlock_pair(curenv, e);
+
+    env_set_status(e, ENV_RUNNABLE);
+    return e->env_id;
+
+bad:
+    env_unlock_pair(curenv, e);
+    env_free(e);
+    return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -112,8 +203,22 @@ sys_env_set_status(envid_t envid, int status)
         return r;
     if (status != ENV_RUNNABLE && status != ENV_NOT_RUNNABLE)
         return -E_INVAL;
-    e->env_status = status;
-    return 0;
+
+    spin_lock(&env_table_lock);
+    if (!env_is_live(e, envid))
+        r = -E_BAD_ENV;
+    else if (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE) {
+        env_set_status_locked(e, status);
+    } else if (e == curenv && status == ENV_NOT_RUNNABLE) {
+        // Once we let go of curenv another CPU may resume it before
+        // syscall() stores this return value, so store it now too.
+        e->env_tf.tf_regs.reg_rax = 0;
+        env_set_status_locked(e, status);
+    }
+    // Otherwise e is running on (or being destroyed by) another CPU,
+    // and only that CPU may take it off the processor.
+    spin_unlock(&env_table_lock);
+    return r;
 }
 
 // Set envid's trap frame to 'tf'.
@@ -130,14 +235,16 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
     struct Env *e;
     struct Trapframe ltf;
 
-    user_mem_assert(curenv, tf, sizeof(struct Trapframe), PTE_U);
+    user_mem_lock(curenv, tf, sizeof(struct Trapframe), PTE_U);
     ltf = *tf;
+    env_unlock(curenv);
     ltf.tf_eflags |= FL_IF;
     ltf.tf_cs |= 3;
 
-    if ((r = envid2env(envid, &e, 1)) < 0)
+    if ((r = envid2env_lock(envid, &e, 1)) < 0)
         return r;
     e->env_tf = ltf;
+    env_unlock(e);
     return 0;
 }
 
@@ -155,9 +262,10 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
     int r;
     struct Env *e;
 
-    if ((r = envid2env(envid, &e, 1)) < 0)
+    if ((r = envid2env_lock(envid, &e, 1)) < 0)
         return r;
     e->env_pgfault_upcall = func;
+    env_unlock(e);
     return 0;
 }
 
@@ -169,12 +277,15 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //
 // perm -- PTE_U | PTE_P must be set, PTE_AVAIL | PTE_W may or may not be set,
 //         but no other bits may be set.  See PTE_SYSCALL in inc/mmu.h.
+//         PTE_PS asks for a 2MB page instead; va must then be
+//         PTSIZE-aligned, and everything in [va, va+PTSIZE) is unmapped.
 //
 // Return 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
 //	-E_INVAL if perm is inappropriate (see above).
+//	-E_INVAL if va (without PTE_PS) lies in a 2MB page.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -186,18 +297,27 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 
     if ((r = envid2env(envid, &e, 1)) < 0)
         return r;
-    if ((~perm & (PTE_U | PTE_P)) || (perm & ~PTE_SYSCALL))
+    if ((~perm & (PTE_U | PTE_P)) || (perm & ~(PTE_SYSCALL | PTE_PS)))
         return -E_INVAL;
     if (va >= (void *)UTOP)
         return -E_INVAL;
-    if (!(pp = page_alloc(ALLOC_ZERO)))
+    if ((perm & PTE_PS) && va != ROUNDDOWN(va, PTSIZE))
+        return -E_INVAL;
+    if (!(pp = (perm & PTE_PS) ? page_alloc_large(ALLOC_ZERO)
+                               : page_alloc(ALLOC_ZERO)))
         return -E_NO_MEM;
-    if ((r = page_insert(e->env_pml4e, pp, va, perm)) < 0)
-    {
+
+    env_lock(e);
+    if (!env_is_live(e, envid))
+        r = -E_BAD_ENV;
+    else if (perm & PTE_PS)
+        r = page_insert_large(e->env_pml4e, pp, va, perm & ~PTE_PS);
+    else
+        r = page_insert(e->env_pml4e, pp, va, perm);
+    env_unlock(e);
+    if (r < 0)
         page_free(pp);
-        return r;
-    }
-    return 0;
+    return r;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -215,6 +335,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva lies in a 2MB page, or dstva does.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -234,13 +355,23 @@ sys_page_map(envid_t srcenvid, void *srcva,
         return r;
     if ((~perm & (PTE_U | PTE_P)) || (perm & ~PTE_SYSCALL))
         return -E_INVAL;
+
+    env_lock_pair(es, ed);
+    r = -E_BAD_ENV;
+    if (!env_is_live(es, srcenvid) || !env_is_live(ed, dstenvid))
+        goto out;
+    r = -E_INVAL;
     if ((pp = page_lookup(es->env_pml4e, srcva, &ppte)) == 0)
-        return -E_INVAL;
+        goto out;
     if ((perm & PTE_W) && !(*ppte & PTE_W))
-        return -E_INVAL;
-    if ((r = page_insert(ed->env_pml4e, pp, dstva, perm)) < 0)
-        return r;
-    return 0;
+        goto out;
+    // Large pages can't be mapped piecewise.
+    if (page_is_large(es->env_pml4e, srcva))
+        goto out;
+    r = page_insert(ed->env_pml4e, pp, dstva, perm);
+out:
+    env_unlock_pair(es, ed);
+    return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -260,16 +391,89 @@ sys_page_unmap(envid_t envid, void *va)
         return r;
     if (va >= (void *)UTOP || PGOFF(va))
         return -E_INVAL;
-    page_remove(e->env_pml4e, va);
-    return 0;
+    env_lock(e);
+    if (env_is_live(e, envid))
+        page_remove(e->env_pml4e, va);
+    else
+        r = -E_BAD_ENV;
+    env_unlock(e);
+    return r;
+}
+
+// Reserve [va, va+len) in curenv's address space as demand-zero memory:
+// no pages are allocated now, and the first touch of each page maps a
+// zeroed page with 'perm' (see page_zero_fault), without a trip
+// through the user page fault handler.  Pages that are already mapped
+// are left alone, and a page unmapped later reads as zeros again.
+// Children created with sys_fork inherit curenv's regions.
+//
+// With perm 0, release the region reserved at exactly [va, va+len)
+// instead, and unmap all its pages.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if va is not page-aligned, len is 0, or the range
+//		doesn't fit below UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if the range overlaps another region, or, to release,
+//		if no region covers exactly [va, va+len).
+//	-E_NO_MEM if curenv already has ENV_NREGION regions.
+static int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+    uintptr_t start = (uintptr_t) va, end = start + ROUNDUP(len, PGSIZE);
+    struct EnvRegion *er, *slot = 0;
+    int r = 0;
+
+    if (PGOFF(start) || len == 0 || end <= start || end > UTOP)
+        return -E_INVAL;
+    if (perm && ((~perm & (PTE_U | PTE_P)) || (perm & ~PTE_SYSCALL)))
+        return -E_INVAL;
+
+    env_lock(curenv);
+    for (er = curenv->env_regions; er < curenv->env_regions + ENV_NREGION; er++) {
+        if (er->er_start == er->er_end) {
+            if (!slot)
+                slot = er;
+        } else if (!perm && er->er_start == start && er->er_end == end)
+            break;
+        else if (perm && start < er->er_end && er->er_start < end) {
+            r = -E_INVAL;
+            goto out;
+        }
+    }
+
+    if (perm) {
+        if (!slot) {
+            r = -E_NO_MEM;
+            goto out;
+        }
+        slot->er_start = start;
+        slot->er_end = end;
+        slot->er_perm = perm;
+    } else {
+        if (er == curenv->env_regions + ENV_NREGION) {
+            r = -E_INVAL;
+            goto out;
+        }
+        er->er_start = er->er_end = 0;
+        for (; start < end; start += PGSIZE)
+            page_remove(curenv->env_pml4e, (void *) start);
+    }
+out:
+    env_unlock(curenv);
+    return r;
 }
 
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If perm includes IPC_NPAGES(n), send the n pages starting at srcva,
+// of which the receiver maps up to its env_ipc_maxpages.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
+// If the target is not blocked, waiting for an IPC, the message is
+// queued for its next sys_ipc_recv instead (see kern/ipc.c).  The send
+// fails with a return value of -E_IPC_NOT_RECV if the target's queue
+// is full, or if either environment is a guest, which can't queue.
 //
 // The send also can fail for the other reasons listed below.
 //
@@ -278,10 +482,13 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
+// ipc_send_locked does everything but that; its callers either make
+// the target runnable or switch to it directly (ipc_recv_after_send).
 //
 // If the sender wants to send a page but the receiver isn't asking for one,
 // then no page mapping is transferred, but no error occurs.
@@ -292,12 +499,12 @@ sys_page_unmap(envid_t envid, void *va)
 // the kernel address range).  You will need to add a special case to allow
 // accesses from ENV_TYPE_GUEST when srcva > UTOP.
 //
-// Returns 0 on success, < 0 on error.
+// ipc_send_locked returns 0 if the message was delivered, IPC_QUEUED
+// if it was queued, < 0 on error.
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if envid's message queue is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -305,20 +512,72 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
+//	-E_INVAL if more than IPC_MAXPAGES pages are sent, or any page
+//		in the range fails the checks above, or a guest is
+//		involved in a send of several pages.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
 //		address space.
+#define IPC_QUEUED	1
+
+// Look up the 'npages' pages curenv is sending from 'srcva' with
+// 'perm'.  One user_mem_check covers the whole range.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+ipc_lookup_pages(void *srcva, unsigned perm, int npages,
+                 struct PageInfo **pages)
 {
-    int r;
-    struct Env *e;
-    struct PageInfo *pp;
+    int i;
+
+    if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL)) {
+        cprintf("[%08x] bad perm %x in sys_ipc_try_send\n", curenv->env_id, perm);
+        return -E_INVAL;
+    }
+
+    if (npages > IPC_MAXPAGES || PGOFF(srcva) ||
+        (uintptr_t) srcva + npages * PGSIZE > UTOP) {
+        cprintf("[%08x] bad range %08x+%d pages in sys_ipc_try_send\n", curenv->env_id, srcva, npages);
+        return -E_INVAL;
+    }
+
+    if (user_mem_check(curenv, srcva, npages * PGSIZE, PTE_U | (perm & PTE_W)) < 0) {
+        cprintf("[%08x] range %08x+%d pages unmapped or read-only in sys_ipc_try_send\n", curenv->env_id, srcva, npages);
+        return -E_INVAL;
+    }
+
+    for (i = 0; i < npages; i++) {
+        pages[i] = page_lookup(curenv->env_pml4e, srcva + i * PGSIZE, 0);
+        if (page_is_large(curenv->env_pml4e, srcva + i * PGSIZE)) {
+            cprintf("[%08x] attempt to send part of a large page in sys_ipc_try_send\n", curenv->env_id);
+            return -E_INVAL;
+        }
+    }
+    return 0;
+}
+
+static int
+ipc_send_locked(struct Env *e, uint32_t value, void *srcva, unsigned perm)
+{
+    int r, npages;
+    struct PageInfo *pp, *pages[IPC_MAXPAGES];
     pte_t *ppte;
-    if ((r = envid2env(envid, &e, 0)) < 0)
-        return r;
-    if (!e->env_ipc_recving) {
+
+    npages = IPC_PERM_NPAGES(perm);
+    perm &= IPC_PERM_MASK;
+    if (npages > 1 &&
+        (curenv->env_type == ENV_TYPE_GUEST || e->env_type == ENV_TYPE_GUEST))
+        return -E_INVAL;
+
+    if (!e->env_ipc_recving ||
+        (e->env_ipc_expect && e->env_ipc_expect != curenv->env_id)) {
         /* cprintf("[%08x] not recieving!\n", e->env_id); */
-        return -E_IPC_NOT_RECV;
+        if (curenv->env_type == ENV_TYPE_GUEST || e->env_type == ENV_TYPE_GUEST)
+            return -E_IPC_NOT_RECV;
+        if (srcva >= (void*) UTOP)
+            npages = 0;
+        else if ((r = ipc_lookup_pages(srcva, perm, npages, pages)) < 0)
+            return r;
+        if ((r = ipc_enqueue(e, value, pages, npages, perm)) < 0)
+            return r;
+        return IPC_QUEUED;
     }
 
     /*  Hint: check if environment is ENV_TYPE_GUEST or not, and if the source or destination 
@@ -331,13 +590,14 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
           return r;
         } 
         e->env_ipc_perm = perm;
+        e->env_ipc_npages = 1;
         
     } else if (e->env_type == ENV_TYPE_GUEST && srcva < (void *) UTOP) {
 
         if (((pp = page_lookup(curenv->env_pml4e, srcva, &ppte)) == 0)) {
             return -E_INVAL;
         } 
-        if ((!(*ppte & PTE_W) && (perm & PTE_W))) {
+        if ((!(*ppte & PTE_W) && (perm & PTE_W)) || page_is_large(curenv->env_pml4e, srcva)) {
             return -E_INVAL;
         } 
         #ifndef VMM_GUEST
@@ -345,31 +605,20 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
         #endif
 
     } else if (srcva < (void*) UTOP && e->env_ipc_dstva < (void*) UTOP) {
-        if ((~perm & (PTE_U|PTE_P)) || (perm & ~PTE_SYSCALL)) {
-            cprintf("[%08x] bad perm %x in sys_ipc_try_send\n", curenv->env_id, perm);
-            return -E_INVAL;
-        }
-
-        pp = page_lookup(curenv->env_pml4e, srcva, &ppte);
-        if (pp == 0) {
-            cprintf("[%08x] page_lookup %08x failed in sys_ipc_try_send\n", curenv->env_id, srcva);
-            return -E_INVAL;
-        }
-
-        if ((perm & PTE_W) && !(*ppte & PTE_W)) {
-            cprintf("[%08x] attempt to send read-only page read-write in sys_ipc_try_send\n", curenv->env_id);
-            return -E_INVAL;
-        }
+        if ((r = ipc_lookup_pages(srcva, perm, npages, pages)) < 0)
+            return r;
 
-        r = page_insert(e->env_pml4e, pp, e->env_ipc_dstva, perm);
+        r = ipc_map_pages(e, pages, npages, perm);
         if (r < 0) {
             cprintf("[%08x] page_insert %08x failed in sys_ipc_try_send (%e)\n", curenv->env_id, srcva, r);
             return r;
         }
 
         e->env_ipc_perm = perm;
+        e->env_ipc_npages = r;
     } else {
         e->env_ipc_perm = 0;
+        e->env_ipc_npages = 0;
     }
 
     e->env_ipc_recving = 0;
@@ -377,38 +626,207 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
     e->env_ipc_value = value;
     e->env_tf.tf_regs.reg_rax = 0;
 
-    e->env_status = ENV_RUNNABLE;
-
     if(e->env_type == ENV_TYPE_GUEST) {
         e->env_tf.tf_regs.reg_rsi = value;
     }
     return 0;
 }
 
+// Wake an environment that ipc_send_locked delivered to.
+static void
+ipc_wake_locked(struct Env *e)
+{
+    // It may have been destroyed, or set running by its parent.
+    if (e->env_status == ENV_NOT_RUNNABLE)
+        env_set_status_locked(e, ENV_RUNNABLE);
+}
+
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    // The sender's lock keeps srcva mapped, the receiver's guards its
+    // IPC state and address space.
+    env_lock_pair(curenv, e);
+    if (env_is_live(e, envid))
+        r = ipc_send_locked(e, value, srcva, perm);
+    else
+        r = -E_BAD_ENV;
+    if (r == 0) {
+        spin_lock(&env_table_lock);
+        ipc_wake_locked(e);
+        spin_unlock(&env_table_lock);
+    }
+    env_unlock_pair(curenv, e);
+    return r < 0 ? r : 0;
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
+// If a message is already queued, take it without blocking.
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
-// This function only returns on error, but the system call will eventually
-// return 0 on success.
+// This function only returns on error or if a message was queued, but
+// the system call will eventually return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
 static int
 sys_ipc_recv(void *dstva)
 {
-    if (curenv->env_ipc_recving)
+    struct Env *e = curenv;
+
+    // Hold our own lock until we are off the CPU, so that a sender
+    // can't make us runnable before we are blocked.
+    env_lock(e);
+    if (e->env_ipc_recving)
         panic("already recving!");
 
-    curenv->env_ipc_recving = 1;
-    curenv->env_ipc_dstva = dstva;
-    curenv->env_status = ENV_NOT_RUNNABLE;
+    e->env_ipc_recving = 1;
+    e->env_ipc_dstva = dstva;
+    e->env_ipc_expect = 0;
+    if (ipc_dequeue(e)) {
+        env_unlock(e);
+        return 0;
+    }
+    env_set_status(e, ENV_NOT_RUNNABLE);
+    env_unlock(e);
     sched_yield();
     return 0;
 }
 
+// Set how many pages curenv accepts in one IPC message, from 1 (the
+// default) to IPC_MAXPAGES.  The pages of a message are mapped
+// starting at the dstva given to sys_ipc_recv, so the caller must
+// leave npages pages free there.
+// Returns 0 on success, -E_INVAL if npages is out of range.
+static int
+sys_ipc_set_maxpages(int npages)
+{
+    if (npages < 1 || npages > IPC_MAXPAGES)
+        return -E_INVAL;
+    curenv->env_ipc_maxpages = npages;
+    return 0;
+}
+
+// Second half of sys_ipc_call and sys_ipc_reply_wait.  curenv has
+// just sent a message to 'e' (both their locks are held), and now
+// receives at 'dstva' from 'from' (0 for anyone).  'sent' is what
+// ipc_send_locked returned.
+//
+// If the message was delivered, e is the environment with something
+// to do, so rather than making it runnable and going through
+// sched_yield, this CPU runs it directly.  This falls back to the
+// scheduler if e was destroyed or woken some other way meanwhile, if
+// it is a guest, or if curenv is dying.
+//
+// Releases both locks.  Returns 0 only if a message for curenv was
+// already queued; otherwise curenv blocks and this does not return.
+static int
+ipc_recv_after_send(struct Env *e, int sent, void *dstva, envid_t from)
+{
+    struct Env *self = curenv;
+
+    self->env_ipc_recving = 1;
+    self->env_ipc_dstva = dstva;
+    self->env_ipc_expect = from;
+
+    // A server may find its next request already waiting.
+    if (!from && ipc_dequeue(self)) {
+        if (sent == 0) {
+            spin_lock(&env_table_lock);
+            ipc_wake_locked(e);
+            spin_unlock(&env_table_lock);
+        }
+        env_unlock_pair(self, e);
+        return 0;
+    }
+
+    spin_lock(&env_table_lock);
+    // This nulls curenv, unless another CPU is destroying self.
+    env_set_status_locked(self, ENV_NOT_RUNNABLE);
+    env_unlock_pair(self, e);
+
+    if (sent == 0) {
+        if (!curenv && e->env_status == ENV_NOT_RUNNABLE &&
+            e->env_type != ENV_TYPE_GUEST)
+            env_run(e);
+        ipc_wake_locked(e);
+    }
+    spin_unlock(&env_table_lock);
+    sched_yield();
+}
+
+// Send a message to 'envid' as sys_ipc_try_send does, then block until
+// envid replies, receiving the reply as sys_ipc_recv(dstva) would.
+// Messages from anyone other than envid are queued meanwhile.  The
+// send and the receive are one step, so the reply can't come before
+// the caller is receiving, and if envid was waiting for the message
+// the caller's CPU switches straight to it.
+//
+// Returns 0 once the reply has arrived (when curenv runs again), or
+// the errors of sys_ipc_try_send if the message could not be sent.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             void *dstva)
+{
+    int r;
+    struct Env *e;
+
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    // Nobody would be left to reply.
+    if (e == curenv)
+        return -E_INVAL;
+    env_lock_pair(curenv, e);
+    if (env_is_live(e, envid))
+        r = ipc_send_locked(e, value, srcva, perm);
+    else
+        r = -E_BAD_ENV;
+    if (r < 0) {
+        env_unlock_pair(curenv, e);
+        return r;
+    }
+    return ipc_recv_after_send(e, r, dstva, envid);
+}
+
+// The server side of sys_ipc_call: reply to 'envid' and wait for the
+// next request, as sys_ipc_try_send followed by sys_ipc_recv(dstva).
+// If envid is 0 there is nothing to reply and this just receives.
+//
+// Returns 0 once a request has arrived, or the errors of
+// sys_ipc_try_send (without receiving) if the reply could not be sent.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva,
+                   unsigned perm, void *dstva)
+{
+    int r;
+    struct Env *e;
+
+    if (envid == 0)
+        return sys_ipc_recv(dstva);
+    if ((r = envid2env(envid, &e, 0)) < 0)
+        return r;
+    if (e == curenv)
+        return -E_INVAL;
+    env_lock_pair(curenv, e);
+    if (env_is_live(e, envid))
+        r = ipc_send_locked(e, value, srcva, perm);
+    else
+        r = -E_BAD_ENV;
+    if (r < 0) {
+        env_unlock_pair(curenv, e);
+        return r;
+    }
+    return ipc_recv_after_send(e, r, dstva, 0);
+}
+
 // Return the current time.
 static int
 sys_time_msec(void)
@@ -416,18 +834,82 @@ sys_time_msec(void)
     return (int)time_msec();
 }
 
+// Return nanoseconds since boot, read from the TSC.
+static int64_t
+sys_time_ns(void)
+{
+    return time_ns();
+}
+
+// Timers that end sys_sleep_until, one per envs[] slot.  Each sleep
+// re-arms its slot's timer, so a timer left over from a sleep that
+// ended early is simply replaced.
+static struct timer sleep_timers[NENV];
+
+static void
+sleep_timer_fired(uint64_t envx)
+{
+    struct Env *e = &envs[envx];
+
+    spin_lock(&env_table_lock);
+    if (e->env_sleep == ENV_SLEEP_UNTIL)
+        env_set_status_locked(e, ENV_RUNNABLE);
+    spin_unlock(&env_table_lock);
+}
+
+// Block until time_msec() reaches 'msec', without using the CPU.
+// The sleep may end early if another environment marks us runnable,
+// so callers that need the full delay should check the time and loop.
+// Returns 0.
+static int
+sys_sleep_until(unsigned int msec)
+{
+    struct Env *e = curenv;
+    struct timer *t = &sleep_timers[ENVX(e->env_id)];
+
+    if (time_msec() >= msec)
+        return 0;
+
+    if (!t->t_func)
+        timer_init(t, sleep_timer_fired, ENVX(e->env_id));
+    timer_set(t, time_msec_to_ticks(msec));
+
+    // The timer may already have gone off, finding us awake; then the
+    // time check below sees that the deadline has passed.
+    spin_lock(&env_table_lock);
+    if (time_msec() >= msec) {
+        spin_unlock(&env_table_lock);
+        return 0;
+    }
+    e->env_tf.tf_regs.reg_rax = 0;
+    env_set_status_locked(e, ENV_NOT_RUNNABLE);
+    if (e->env_status == ENV_NOT_RUNNABLE)
+        e->env_sleep = ENV_SLEEP_UNTIL;
+    spin_unlock(&env_table_lock);
+    sched_yield();
+    return 0;
+}
+
 static int
 sys_net_transmit(const void *data, size_t len)
 {
-    user_mem_assert(curenv, data, len, 0);
-    return e1000_transmit(data, len);
+    int r;
+
+    user_mem_lock(curenv, data, len, 0);
+    r = e1000_transmit(data, len);
+    env_unlock(curenv);
+    return r;
 }
 
 static int
 sys_net_receive(void *buf, size_t len)
 {
-    user_mem_assert(curenv, buf, len, PTE_W);
-    return e1000_receive(buf, len);
+    int r;
+
+    user_mem_lock(curenv, buf, len, PTE_W);
+    r = e1000_receive(buf, len);
+    env_unlock(curenv);
+    return r;
 }
 
 #ifndef VMM_GUEST
@@ -469,6 +951,7 @@ sys_vmx_incr_vmdisk_number()
 //	-E_INVAL if perm is inappropriate
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva lies in a 2MB page, or dstva does.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 //
 // Hint: Use ept_map_hva2gpa().  A guest environment uses
@@ -496,22 +979,31 @@ sys_ept_map(envid_t srcenvid, void *srcva,
     // Next we must check for Alignment & Bounds of guest
     if (srcva != ROUNDDOWN(srcva, PGSIZE)|| guest_pa != ROUNDDOWN(guest_pa, PGSIZE)) {
         return -E_INVAL;
+    }
+    env_lock_pair(src_env, guest_env);
+    if (!env_is_live(src_env, srcenvid) || !env_is_live(guest_env, guest)) {
+        res = -E_BAD_ENV;
+        goto out;
     }
 	// Make sure we have a corresponding page
     pte_t *pte;
     struct PageInfo *pg = page_lookup(src_env->env_pml4e, srcva, &pte);
     // taken from sys_page_map
-    if (!(perm & __EPTE_FULL) || !pg || ((perm & PTE_W) && !(*pte & PTE_W))) {
-        return -E_INVAL; 
+    if (!(perm & __EPTE_FULL) || !pg || ((perm & PTE_W) && !(*pte & PTE_W)) || page_is_large(src_env->env_pml4e, srcva)) {
+        res = -E_INVAL;
+        goto out;
     }
     // Now we need to do the mapping
     void *kernel_va = page2kva(pg);
     if ((res = ept_map_hva2gpa((epte_t *)guest_env->env_pml4e, kernel_va, guest_pa, perm, 0)) < 0) {    
-        return res;
+        goto out;
     }
 
-    pg->pp_ref += 1;
-    return 0;
+    __sync_fetch_and_add(&pg->pp_ref, 1);
+    res = 0;
+out:
+    env_unlock_pair(src_env, guest_env);
+    return res;
 }
 
 static envid_t
@@ -532,17 +1024,135 @@ sys_env_mkguest(uint64_t gphysz, uint64_t gRIP)
     if ((r = env_guest_alloc(&e, curenv->env_id)) < 0)
         return r;
 
-    e->env_status = ENV_NOT_RUNNABLE;
     e->env_vmxinfo.phys_sz = gphysz;
     e->env_tf.tf_rip = gRIP;
     return e->env_id;
 }
 #endif //! VMM_GUEST
 
+// Apply the 'n' page-mapping operations in the array 'ops' in one
+// trap.  Each entry is carried out exactly as the system call named by
+// its 'op' (see inc/syscall.h) would, and its result is stored in its
+// 'status' field.  Processing stops at the first entry that fails.
+//
+// Returns the number of entries that succeeded (n if all did),
+// or < 0 on error.  Errors are:
+//	-E_INVAL if n < 0 or n > PAGEOP_MAX.
+// Destroys the environment if 'ops' is not writable user memory, both
+// before the batch and after it (an entry may unmap 'ops' itself).
+static int
+sys_page_batch(struct PageOp *ops, int n)
+{
+    int i, j, r, nran;
+    struct PageOp batch[PAGEOP_MAX], *o;
+
+    if (n < 0 || n > PAGEOP_MAX)
+        return -E_INVAL;
+
+    // Each operation may lock curenv itself, so check and copy the
+    // whole array in once rather than holding curenv's lock across
+    // the batch.
+    user_mem_lock(curenv, ops, n * sizeof(ops[0]), PTE_U | PTE_W);
+    memmove(batch, ops, n * sizeof(ops[0]));
+    env_unlock(curenv);
+
+    for (i = 0; i < n; i++) {
+        o = &batch[i];
+        switch (o->op) {
+        case PAGEOP_ALLOC:
+            r = sys_page_alloc(o->dstenv, o->dstva, o->perm);
+            break;
+        case PAGEOP_MAP:
+            r = sys_page_map(o->srcenv, o->srcva, o->dstenv, o->dstva, o->perm);
+            break;
+        case PAGEOP_UNMAP:
+            r = sys_page_unmap(o->dstenv, o->dstva);
+            break;
+#ifndef VMM_GUEST
+        case PAGEOP_EPT_MAP:
+            r = sys_ept_map(o->srcenv, o->srcva, o->dstenv, o->dstva, o->perm);
+            break;
+#endif
+        default:
+            r = -E_INVAL;
+        }
+        o->status = r;
+        if (r < 0)
+            break;
+    }
+
+    // Report the statuses of the entries that ran, including the one
+    // that failed.
+    nran = i < n ? i + 1 : n;
+    user_mem_lock(curenv, ops, nran * sizeof(ops[0]), PTE_U | PTE_W);
+    for (j = 0; j < nran; j++)
+        ops[j].status = batch[j].status;
+    env_unlock(curenv);
+    return i;
+}
+
+// Register the page at 'ring' as curenv's system call ring (see
+// inc/syscall.h), replacing any earlier one.  From then on, every
+// system call from curenv first runs the calls queued in the ring, so
+// independent calls can be queued and run together on one trap.
+// Other traps (interrupts, page faults) leave the ring alone, since
+// they may come while the environment is halfway through an entry.
+// Only calls that never block or switch environments may be queued;
+// others complete with -E_INVAL.
+// A ring address at or above UTOP unregisters curenv's ring.
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if ring is not page-aligned.
+//	-E_FAULT if ring is not mapped writable.
+static int
+sys_ring_setup(struct SysRing *ring)
+{
+    int r;
+
+    if ((uintptr_t) ring >= UTOP) {
+        curenv->env_ring = 0;
+        return 0;
+    }
+    if (PGOFF(ring))
+        return -E_INVAL;
+    env_lock(curenv);
+    r = user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W);
+    env_unlock(curenv);
+    if (r < 0)
+        return r;
+    curenv->env_ring = ring;
+    return 0;
+}
+
+// Run the calls queued in curenv's ring.  Entering this call already
+// did, so this only has to report the results.
+// Returns the number of completions waiting to be reaped, or < 0 on
+// error.  Errors are:
+//	-E_INVAL if curenv has no ring.
+//	-E_FAULT if the ring is no longer mapped writable.
+static int
+sys_ring_enter(void)
+{
+    struct SysRing *ring = curenv->env_ring;
+    int n;
+
+    if (!ring)
+        return -E_INVAL;
+    ring_drain();
+    env_lock(curenv);
+    if (user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W) < 0)
+        n = -E_FAULT;
+    else
+        n = MIN(ring->sr_cq_tail - ring->sr_cq_head, RING_NCQE);
+    env_unlock(curenv);
+    return n;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int64_t
 syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5)
 {
+    curenv->env_syscalls++;
+
     switch (syscallno)
     {
     case SYS_cputs:
@@ -562,6 +1172,8 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
         return sys_page_unmap(a1, (void *)a2);
     case SYS_exofork:
         return sys_exofork();
+    case SYS_fork:
+        return sys_fork();
     case SYS_env_set_status:
         return sys_env_set_status(a1, a2);
     case SYS_env_set_trapframe:
@@ -573,11 +1185,38 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
         return 0;
     case SYS_ipc_try_send:
         return sys_ipc_try_send(a1, a2, (void *)a3, a4);
+    case SYS_ipc_call:
+        return sys_ipc_call(a1, a2, (void *)a3, a4, (void *)a5);
+    case SYS_ipc_reply_wait:
+        return sys_ipc_reply_wait(a1, a2, (void *)a3, a4, (void *)a5);
     case SYS_ipc_recv:
         sys_ipc_recv((void *)a1);
         return 0;
+    case SYS_ipc_set_maxpages:
+        return sys_ipc_set_maxpages(a1);
+    case SYS_ring_setup:
+        return sys_ring_setup((struct SysRing *)a1);
+    case SYS_ring_enter:
+        return sys_ring_enter();
+    case SYS_region_reserve:
+        return sys_region_reserve((void *)a1, a2, a3);
     case SYS_time_msec:
         return sys_time_msec();
+    case SYS_page_batch:
+        return sys_page_batch((struct PageOp *)a1, a2);
+    case SYS_sleep_until:
+        return sys_sleep_until(a1);
+    case SYS_time_ns:
+        return sys_time_ns();
+    case SYS_futex_wait:
+        return futex_wait((const uint32_t *)a1, a2, a3);
+    case SYS_futex_wake:
+        return futex_wake((const uint32_t *)a1, a2);
+    case SYS_env_exit:
+        sys_env_exit(a1);
+        return 0;
+    case SYS_env_wait:
+        return sys_env_wait(a1);
     case SYS_net_transmit:
         return sys_net_transmit((const void *)a1, a2);
     case SYS_net_receive:
@@ -604,6 +1243,87 @@ syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
     }
 }
 
+// Lock curenv and check that its ring is still mapped writable, since
+// the environment may unmap it at any time.  Returns false, with curenv
+// unlocked, if it isn't.
+static bool
+ring_lock(struct SysRing *ring)
+{
+    env_lock(curenv);
+    if (user_mem_check(curenv, ring, sizeof(*ring), PTE_U | PTE_W) < 0) {
+        env_unlock(curenv);
+        return false;
+    }
+    return true;
+}
+
+// Run one queued call, if it is one that a ring may queue.
+static int64_t
+ring_syscall(struct RingSqe *sqe)
+{
+    uint64_t *a = sqe->sqe_args;
+
+    switch (sqe->sqe_syscallno) {
+    case SYS_cputs:
+    case SYS_getenvid:
+    case SYS_page_alloc:
+    case SYS_page_map:
+    case SYS_page_unmap:
+    case SYS_ipc_try_send:
+    case SYS_time_msec:
+    case SYS_time_ns:
+    case SYS_futex_wake:
+    case SYS_net_transmit:
+    case SYS_net_receive:
+        return syscall(sqe->sqe_syscallno, a[0], a[1], a[2], a[3], a[4]);
+    default:
+        return -E_INVAL;
+    }
+}
+
+// Run the calls queued in curenv's ring, in order, until its
+// submission queue is empty or its completion queue is full.  Every
+// system call from an environment with a ring calls this first.
+// Returns the number of calls run.
+int
+ring_drain(void)
+{
+    struct SysRing *ring = curenv->env_ring;
+    struct RingSqe sqe;
+    struct RingCqe *cqe;
+    uint32_t head;
+    int64_t res;
+    int n = 0;
+
+    for (;;) {
+        // Each call may lock curenv itself, so copy the entry out
+        // rather than holding curenv's lock across the call.
+        if (!ring_lock(ring))
+            break;
+        head = ring->sr_sq_head;
+        if (head == ring->sr_sq_tail
+            || ring->sr_cq_tail - ring->sr_cq_head >= RING_NCQE) {
+            env_unlock(curenv);
+            break;
+        }
+        sqe = ring->sr_sq[head % RING_NSQE];
+        ring->sr_sq_head = head + 1;
+        env_unlock(curenv);
+
+        res = ring_syscall(&sqe);
+        n++;
+
+        if (!ring_lock(ring))
+            break;
+        cqe = &ring->sr_cq[ring->sr_cq_tail % RING_NCQE];
+        cqe->cqe_data = sqe.sqe_data;
+        cqe->cqe_res = res;
+        ring->sr_cq_tail++;
+        env_unlock(curenv);
+    }
+    return n;
+}
+
 #ifdef TEST_EPT_MAP
 int _export_sys_ept_map(envid_t srcenvid, void *srcva,
                         envid_t guest, void *guest_pa, int perm)
@@ -1,27 +1,184 @@
 #line 2 "../kern/time.c"
 #include <kern/time.h>
+#include <kern/spinlock.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// Timer ticks since boot.  64 bits, so that it can't wrap before
+// time_msec() does, whatever HZ is.
+static uint64_t ticks;
+
+// TSC counts per second, as measured by lapic_calibrate, and the TSC
+// value time_ns counts from.  tsc_hz is 0 if the TSC wasn't calibrated.
+static uint64_t tsc_hz;
+static uint64_t tsc_base;
+
+struct TimePage *timepage;
+
+// Pending timers live in a hashed timing wheel: a timer expiring at
+// tick t sits on wheel[t % TIMER_SLOTS], so each tick looks at just
+// one slot and skips the timers there that are a lap or more away.
+// Setting and cancelling a timer is O(1).  timer_lock protects the
+// wheel, wheel_now, the last tick whose slot has been run, and
+// timers_armed, the number of timers set and not yet finished firing.
+#define TIMER_SLOTS	256
+
+static struct timer *wheel[TIMER_SLOTS];
+static unsigned int wheel_now;
+static unsigned int timers_armed;
+static struct spinlock timer_lock = { .name = "timer_lock" };
+
+// Copy the clock to the time page, where user programs read it.
+static void
+time_publish(void)
+{
+	timepage->tp_seq++;
+	timepage->tp_hz = HZ;
+	timepage->tp_ticks = ticks;
+	timepage->tp_tsc_hz = tsc_hz;
+	timepage->tp_tsc_base = tsc_base;
+	timepage->tp_seq++;
+}
 
 void
 time_init(void)
 {
 	ticks = 0;
+	time_publish();
+	spin_register(&timer_lock, 1);
+}
+
+static void
+timer_unlink(struct timer *t)
+{
+	if (t->t_pprev) {
+		if ((*t->t_pprev = t->t_next))
+			t->t_next->t_pprev = t->t_pprev;
+		t->t_pprev = NULL;
+	}
+}
+
+static void
+timer_run(unsigned int now)
+{
+	struct timer *t, *next;
+
+	spin_lock(&timer_lock);
+	for (t = wheel[now % TIMER_SLOTS]; t; t = next) {
+		next = t->t_next;
+		if ((int) (t->t_expires - now) > 0)
+			continue;
+		timer_unlink(t);
+		t->t_func(t->t_arg);
+		timers_armed--;
+	}
+	wheel_now = now;
+	spin_unlock(&timer_lock);
 }
 
 // This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
+// fires HZ times a second.
 void
 time_tick(void)
 {
 	ticks++;
-	if (ticks * 10 < ticks)
+	if (ticks * 1000 / HZ > ~0U)
 		panic("time_tick: time overflowed");
+	time_publish();
+	timer_run(ticks);
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return ticks * 1000 / HZ;
+}
+
+// The low 32 bits of the tick count, which timers compare with
+// wraparound.
+unsigned int
+time_ticks(void)
+{
+	return ticks;
+}
+
+// Return the first tick at which time_msec() is at least 'msec'.
+unsigned int
+time_msec_to_ticks(unsigned int msec)
+{
+	return ((uint64_t) msec * HZ + 999) / 1000;
+}
+
+void
+time_set_tsc_hz(uint64_t hz)
+{
+	tsc_hz = hz;
+	tsc_base = read_tsc();
+	time_publish();
+}
+
+// Return nanoseconds since the TSC was calibrated, at the TSC's
+// resolution; without a calibrated TSC, at the timer tick's.
+uint64_t
+time_ns(void)
+{
+	uint64_t d;
+
+	if (!tsc_hz)
+		return ticks * (1000000000 / HZ);
+	// Split d so that d * 10^9 can't overflow.
+	d = read_tsc() - tsc_base;
+	return d / tsc_hz * 1000000000 + d % tsc_hz * 1000000000 / tsc_hz;
+}
+
+void
+timer_init(struct timer *t, void (*func)(uint64_t), uint64_t arg)
+{
+	t->t_pprev = NULL;
+	t->t_func = func;
+	t->t_arg = arg;
+}
+
+// Arrange for t to fire at tick 'expires', replacing any earlier
+// setting.  A time that has already passed fires on the next tick.
+void
+timer_set(struct timer *t, unsigned int expires)
+{
+	struct timer **slot;
+
+	spin_lock(&timer_lock);
+	if (t->t_pprev)
+		timer_unlink(t);
+	else
+		timers_armed++;
+	if ((int) (expires - wheel_now) <= 0)
+		expires = wheel_now + 1;
+	t->t_expires = expires;
+	slot = &wheel[expires % TIMER_SLOTS];
+	if ((t->t_next = *slot))
+		t->t_next->t_pprev = &t->t_next;
+	t->t_pprev = slot;
+	*slot = t;
+	spin_unlock(&timer_lock);
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	spin_lock(&timer_lock);
+	if (t->t_pprev) {
+		timer_unlink(t);
+		timers_armed--;
+	}
+	spin_unlock(&timer_lock);
+}
+
+// Return true if some timer is set.  Its t_func may be about to make
+// an environment runnable, so the system isn't idle for good yet.
+// The count is only decremented after t_func runs, so a caller that
+// holds env_table_lock sees either the timer or what it woke.
+bool
+timer_pending(void)
+{
+	return timers_armed != 0;
 }
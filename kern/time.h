@@ -5,8 +5,38 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+// Timer interrupts per second.  Build with 'make HZ=n' to change it.
+#ifndef HZ
+#define HZ		100
+#endif
+
+// A one-shot kernel timer.  When time_ticks() reaches t_expires,
+// time_tick calls t_func(t_arg) with interrupts off and timer_lock
+// held, so t_func must be short and must not set timers itself.
+struct timer {
+	struct timer *t_next;
+	struct timer **t_pprev;		// NULL if the timer is not pending
+	unsigned int t_expires;		// In ticks
+	void (*t_func)(uint64_t);
+	uint64_t t_arg;
+};
+
+extern struct TimePage *timepage;	// Mapped at UTIME; set up in pmap.c
+
 void time_init(void);
 void time_tick(void);
 unsigned int time_msec(void);
+unsigned int time_ticks(void);
+unsigned int time_msec_to_ticks(unsigned int msec);
+uint64_t time_ns(void);
+void time_set_tsc_hz(uint64_t hz);
+
+void timer_init(struct timer *t, void (*func)(uint64_t), uint64_t arg);
+void timer_set(struct timer *t, unsigned int expires);
+void timer_cancel(struct timer *t);
+bool timer_pending(void);
 
 #endif /* JOS_KERN_TIME_H */
@@ -16,6 +16,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/macro.h>
 #line 22 "../kern/trap.c"
 #include <kern/time.h>
 #line 25 "../kern/trap.c"
@@ -39,6 +40,9 @@ static struct Trapframe *last_tf;
 struct Gatedesc idt[256] = { { 0 } };
 struct Pseudodesc idt_pd = {0,0};
 
+// SYSCALL entry stub in trapentry.S
+void syscall_entry(void);
+
 
 static const char *trapname(int trapno)
 {
@@ -85,7 +89,8 @@ trap_init(void)
 	extern char
 		Xdivide,Xdebug,Xnmi,Xbrkpt,Xoflow,Xbound,
 		Xillop,Xdevice,Xdblflt,Xtss,Xsegnp,Xstack,
-		Xgpflt,Xpgflt,Xfperr,Xalign,Xmchk,Xdefault,Xsyscall;
+		Xgpflt,Xpgflt,Xfperr,Xalign,Xmchk,Xdefault,Xsyscall,
+		Xresched;
 #line 93 "../kern/trap.c"
 	extern char
 		Xirq0,Xirq1,Xirq2,Xirq3,Xirq4,Xirq5,
@@ -143,6 +148,7 @@ trap_init(void)
 	// Use DPL=3 here because system calls are explicitly invoked
 	// by the user process (with "int $T_SYSCALL").
 	SETGATE(idt[T_SYSCALL], 0, GD_KT, &Xsyscall, 3);
+	SETGATE(idt[T_RESCHED], 0, GD_KT, &Xresched, 0);
 #line 153 "../kern/trap.c"
 	idt_pd.pd_lim = sizeof(idt)-1;
 	idt_pd.pd_base = (uint64_t)idt;
@@ -194,6 +200,22 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+#ifndef VMM_GUEST
+	// Fast system calls.  SYSCALL enters syscall_entry at GD_KT with
+	// IF, DF, TF and AC masked; SYSRET returns to GD_UT/GD_UD, which
+	// it finds at fixed offsets from the STAR user base.
+	static_assert(GD_UT == GD_UD + 8);
+	static_assert(offsetof(struct CpuInfo, cpu_syscall_rsp0) == 0);
+	static_assert(offsetof(struct CpuInfo, cpu_syscall_ursp) == 8);
+	thiscpu->cpu_syscall_rsp0 = thiscpu->cpu_ts.ts_esp0;
+	write_msr(KERNEL_GS_BASE_MSR, (uint64_t) thiscpu);
+	write_msr(STAR_MSR, ((uint64_t) (GD_UD - 8) << 48)
+		  | ((uint64_t) GD_KT << 32));
+	write_msr(LSTAR_MSR, (uint64_t) syscall_entry);
+	write_msr(SFMASK_MSR, FL_IF | FL_DF | FL_TF | FL_AC);
+	write_msr(EFER_MSR, read_msr(EFER_MSR) | (1 << EFER_SCE));
+#endif
 }
 
 void
@@ -265,7 +287,9 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 	if (tf->tf_trapno == T_SYSCALL) {
-		// handle system call
+		// handle system call, after any queued in the ring
+		if (curenv->env_ring)
+			ring_drain();
 		tf->tf_regs.reg_rax =
 			syscall(tf->tf_regs.reg_rax,
 				tf->tf_regs.reg_rdx,
@@ -275,6 +299,13 @@ trap_dispatch(struct Trapframe *tf)
 				tf->tf_regs.reg_rsi);
 		return;
 	}
+	if (tf->tf_trapno == T_RESCHED) {
+		// Another CPU made an environment runnable while we were
+		// halted.  If we woke up on our own in the meantime, just
+		// carry on; otherwise trap() goes on to sched_yield.
+		lapic_eoi();
+		return;
+	}
 	if (tf->tf_trapno == T_BRKPT) {
 		// Invoke the kernel monitor.
 		monitor(tf);
@@ -358,10 +389,12 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// Note that we are no longer halted in sched_halt, if we were.
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+	if (thiscpu->cpu_halt_tsc) {
+		thiscpu->cpu_idle_tsc += read_tsc() - thiscpu->cpu_halt_tsc;
+		thiscpu->cpu_halt_tsc = 0;
+	}
 #line 401 "../kern/trap.c"
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
@@ -371,22 +404,13 @@ trap(struct Trapframe *tf)
 #line 411 "../kern/trap.c"
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-#line 414 "../kern/trap.c"
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-#line 418 "../kern/trap.c"
-		lock_kernel();
 #line 421 "../kern/trap.c"
 		assert(curenv);
 #line 423 "../kern/trap.c"
 
 		// Garbage collect if current enviroment is a zombie
-		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
-		}
+		if (curenv->env_status == ENV_DYING)
+			env_destroy(curenv);
 #line 431 "../kern/trap.c"
 
 		// Copy trap frame (which is currently on the stack)
@@ -416,6 +440,64 @@ trap(struct Trapframe *tf)
 #line 461 "../kern/trap.c"
 }
 
+// Return to user mode from 'tf' with SYSRET, which takes %rip from
+// %rcx, %rflags from %r11 and CS/SS from the STAR MSR, and leaves
+// %ds/%es alone.  Only for frames that syscall_entry built.
+static void
+sysret_pop_tf(struct Trapframe *tf)
+{
+	curenv->env_cpunum = cpunum();
+	__asm __volatile("movq %0,%%rsp\n"
+			 POPA
+			 "\taddq $32,%%rsp\n" /* skip es, ds, trapno, errcode */
+			 "\tmovq 0(%%rsp),%%rcx\n"
+			 "\tmovq 16(%%rsp),%%r11\n"
+			 "\tmovq 24(%%rsp),%%rsp\n"
+			 "\tsysretq"
+			 : : "g" (tf) : "memory");
+	panic("sysret failed");  /* mostly to placate the compiler */
+}
+
+// C half of the SYSCALL fast path.  This is trap() cut down to the
+// T_SYSCALL case, except that when the system call comes back without
+// having switched environments it returns with SYSRET instead of iret.
+void
+syscall_fast(struct Trapframe *tf)
+{
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	assert(curenv);
+
+	// Garbage collect if current enviroment is a zombie
+	if (curenv->env_status == ENV_DYING)
+		env_destroy(curenv);
+
+	curenv->env_tf = *tf;
+	tf = &curenv->env_tf;
+	last_tf = tf;
+
+	if (curenv->env_ring)
+		ring_drain();
+
+	tf->tf_regs.reg_rax =
+		syscall(tf->tf_regs.reg_rax,
+			tf->tf_regs.reg_rdx,
+			tf->tf_regs.reg_r10,
+			tf->tf_regs.reg_rbx,
+			tf->tf_regs.reg_rdi,
+			tf->tf_regs.reg_rsi);
+
+	if (!curenv || curenv->env_status != ENV_RUNNING)
+		sched_yield();
+	// sys_env_set_trapframe may have pointed us somewhere SYSRET
+	// can't safely go; let iret deal with it.
+	if (tf->tf_rip >= UTOP || tf->tf_cs != (GD_UT | 3))
+		env_run(curenv);
+
+	sysret_pop_tf(tf);
+}
 
 void
 page_fault_handler(struct Trapframe *tf)
@@ -423,6 +505,7 @@ page_fault_handler(struct Trapframe *tf)
 	uint64_t fault_va;
 #line 469 "../kern/trap.c"
 	struct UTrapframe *utf;
+	int r;
 #line 471 "../kern/trap.c"
 
 	// Read processor's CR2 register to find the faulting address
@@ -436,6 +519,24 @@ page_fault_handler(struct Trapframe *tf)
 #line 485 "../kern/trap.c"
 
 #line 487 "../kern/trap.c"
+	// Copy-on-write and demand-zero faults are resolved right here;
+	// everything else (e.g. the file server's block cache) goes to the
+	// user handler.
+	if (!(tf->tf_err & FEC_PR) && fault_va < UTOP) {
+		env_lock(curenv);
+		r = page_zero_fault(curenv, (void *) fault_va);
+		env_unlock(curenv);
+		if (r == 0)
+			return;
+	}
+	if ((tf->tf_err & FEC_WR) && fault_va < UTOP) {
+		env_lock(curenv);
+		r = page_cow_fault(curenv->env_pml4e, (void *) fault_va);
+		env_unlock(curenv);
+		if (r == 0)
+			return;
+	}
+
 	// See if the environment has installed a user page fault handler.
 	if (curenv->env_pgfault_upcall == 0) {
 		cprintf("[%08x] user fault va %08x ip %08x\n",
@@ -466,7 +567,7 @@ page_fault_handler(struct Trapframe *tf)
 	// If we can't write to the exception stack,
 	// it means the user environment is seriously screwed up,
 	// so just terminate it.
-	user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_U | PTE_W);
+	user_mem_lock(curenv, utf, sizeof(struct UTrapframe), PTE_U | PTE_W);
 
 	// fill utf
 	utf->utf_fault_va = fault_va;
@@ -475,6 +576,7 @@ page_fault_handler(struct Trapframe *tf)
 	utf->utf_rip = tf->tf_rip;
 	utf->utf_eflags = tf->tf_eflags;
 	utf->utf_rsp = tf->tf_rsp;
+	env_unlock(curenv);
 
  	// set user registers so that env_run switches to fault handler
 	tf->tf_rsp = (uintptr_t) utf;
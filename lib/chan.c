@@ -0,0 +1,136 @@
+// Channels: one-way rings of fixed-size slots between a producer and
+// a consumer environment.  The ring lives in PTE_SHARE pages created
+// before fork, so both sides see it at the same address and a message
+// costs a copy into a slot instead of a page mapping and unmapping.
+//
+// The consumer sets cr_waiting just before it blocks on an empty ring,
+// and the producer rings the doorbell, an IPC with no page, only if
+// it finds cr_waiting set after publishing a slot.  A busy consumer is
+// never interrupted; an idle one is woken once per empty to non-empty
+// transition.  The consumer may see a doorbell for a slot it has
+// already read, and must cope with finding the ring empty.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define barrier()	__asm __volatile("" : : : "memory")
+
+static void *
+chan_slot(struct ChanRing *r, uint32_t i)
+{
+	return (char *) r + PGSIZE + (i & (r->cr_nslots - 1)) * r->cr_slotsize;
+}
+
+// Allocate a ring of 'nslots' slots of 'slotsize' bytes at 'va', in a
+// header page followed by the slots.  'nslots' must be a power of two.
+// Create the channel before forking its producer or consumer.
+int
+chan_create(struct Chan *c, void *va, uint32_t nslots, uint32_t slotsize)
+{
+	uintptr_t p, end;
+	int r;
+
+	if (nslots == 0 || (nslots & (nslots - 1)) || slotsize == 0
+	    || (uintptr_t) va % PGSIZE)
+		return -E_INVAL;
+	end = (uintptr_t) va + PGSIZE
+		+ ROUNDUP((uintptr_t) nslots * slotsize, PGSIZE);
+	for (p = (uintptr_t) va; p < end; p += PGSIZE)
+		if ((r = sys_page_alloc(0, (void *) p,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0) {
+			while (p > (uintptr_t) va) {
+				p -= PGSIZE;
+				sys_page_unmap(0, (void *) p);
+			}
+			return r;
+		}
+
+	c->ch_ring = (struct ChanRing *) va;
+	c->ch_ring->cr_head = 0;
+	c->ch_ring->cr_tail = 0;
+	// Nothing has been read yet, so the first slot needs a doorbell.
+	c->ch_ring->cr_waiting = 1;
+	c->ch_ring->cr_nslots = nslots;
+	c->ch_ring->cr_slotsize = slotsize;
+	c->ch_peer = 0;
+	c->ch_doorbell = 0;
+	return 0;
+}
+
+// Make the producer ring 'peer' with IPC value 'doorbell'.
+void
+chan_attach(struct Chan *c, envid_t peer, uint32_t doorbell)
+{
+	c->ch_peer = peer;
+	c->ch_doorbell = doorbell;
+}
+
+// Return the next free slot, or NULL if the ring is full.
+void *
+chan_write_slot(struct Chan *c)
+{
+	struct ChanRing *r = c->ch_ring;
+
+	if (r->cr_tail - r->cr_head == r->cr_nslots)
+		return NULL;
+	return chan_slot(r, r->cr_tail);
+}
+
+// Publish the slot returned by chan_write_slot, and ring the doorbell
+// if the consumer is waiting for it.
+void
+chan_write_commit(struct Chan *c)
+{
+	struct ChanRing *r = c->ch_ring;
+
+	barrier();
+	r->cr_tail++;
+	// xchg is a full barrier, so the consumer either sees the new
+	// tail when it arms or has armed by the time we look.
+	if (xchg(&r->cr_waiting, 0))
+		ipc_send(c->ch_peer, c->ch_doorbell, 0, 0);
+}
+
+// Return the oldest unread slot, or NULL if the ring is empty.
+void *
+chan_read_slot(struct Chan *c)
+{
+	struct ChanRing *r = c->ch_ring;
+
+	if (r->cr_head == r->cr_tail)
+		return NULL;
+	return chan_slot(r, r->cr_head);
+}
+
+// Give the slot returned by chan_read_slot back to the producer.
+void
+chan_read_done(struct Chan *c)
+{
+	barrier();
+	c->ch_ring->cr_head++;
+}
+
+// Ask for a doorbell on the next slot.  Returns true if the ring is
+// still empty, so the caller may block in ipc_recv; false if a slot
+// arrived meanwhile and the caller should read it instead.
+bool
+chan_arm(struct Chan *c)
+{
+	struct ChanRing *r = c->ch_ring;
+
+	xchg(&r->cr_waiting, 1);
+	if (r->cr_head != r->cr_tail) {
+		r->cr_waiting = 0;
+		return false;
+	}
+	return true;
+}
+
+// Block until the ring is non-empty.  Only for a consumer that
+// receives no IPC other than this channel's doorbell.
+void
+chan_wait(struct Chan *c)
+{
+	while (chan_arm(c))
+		ipc_recv(0, 0, 0);
+}
@@ -18,21 +18,35 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
+// len: bytes of fsipcbuf the request and its response use; the pages
+//	covering them (at least one) are granted to the file server.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_len(unsigned type, void *dstva, size_t len)
 {
 	static envid_t fsenv;
+	int npages;
+
 	if (fsenv == 0)
 		fsenv = ipc_find_env(ENV_TYPE_FS);
 
 	//static_assert(sizeof(fsipcbuf) == PGSIZE);
+	static_assert(FSIPC_NPAGES <= IPC_MAXPAGES);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	npages = MAX(ROUNDUP(len, PGSIZE) / PGSIZE, 1);
+
+	return ipc_call(fsenv, type, &fsipcbuf,
+			PTE_P | PTE_W | PTE_U | IPC_NPAGES(npages), dstva, NULL);
+}
+
+// fsipc_len for requests that fit in a page.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipc_len(type, dstva, PGSIZE);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -127,12 +141,12 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 #line 131 "../lib/file.c"
 	int r;
 
+	n = MIN(n, sizeof(fsipcbuf.readRet.ret_buf));
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if ((r = fsipc_len(FSREQ_READ, NULL, n)) < 0)
 		return r;
 	assert(r <= n);
-	assert(r <= PGSIZE);
 	memmove(buf, &fsipcbuf, r);
 	return r;
 #line 145 "../lib/file.c"
@@ -153,11 +167,12 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 #line 160 "../lib/file.c"
 	int r;
 
-	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
+	n = MIN(n, FSIPC_SIZE - offsetof(struct Fsreq_write, req_buf));
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
-	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+	if ((r = fsipc_len(FSREQ_WRITE, NULL,
+			   offsetof(struct Fsreq_write, req_buf) + n)) < 0)
 		return r;
 	assert(r <= n);
 	return r;
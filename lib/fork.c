@@ -1,5 +1,5 @@
 #line 2 "../lib/fork.c"
-// implement fork from user space
+// fork, with a user-level copy-on-write page fault handler
 
 #include <inc/string.h>
 #include <inc/lib.h>
@@ -8,10 +8,6 @@
 #define debug 0
 #line 10 "../lib/fork.c"
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -51,123 +47,25 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-
-#line 89 "../lib/fork.c"
-	void *addr;
-	pte_t pte;
-
-	addr = (void*) (uint64_t)(pn << PGSHIFT);
-	pte = uvpt[pn];
-	
-#line 96 "../lib/fork.c"
-	// if the page is just read-only or is library-shared, map it directly.
-	if (!(pte & (PTE_W|PTE_COW)) || (pte & PTE_SHARE)) {
-		if ((r = sys_page_map(0, addr, envid, addr, pte & PTE_SYSCALL)) < 0)
-			panic("sys_page_map: %e", r);
-		return 0;
-	}
-#line 110 "../lib/fork.c"
-
-	// The order is VERY important here -- if we swap these and fault on
-	// addr between them, then the child will see all the updates we make
-	// to that page until it copies it.
-	//
-	// Probably this could only occur for the current stack page,
-	// but if we managed to return from fork before the other env
-	// got a chance to run, the stack frame would be lost and bad
-	// things would happen when the child's fork returned.
-	//
-	// Even if we think the page is already copy-on-write in our
-	// address space, we need to mark it copy-on-write again after
-	// the first sys_page_map, just in case a page fault has caused
-	// us to copy the page in the interim.
-
-	if ((r = sys_page_map(0, addr, envid, addr, PTE_P|PTE_U|PTE_COW)) < 0)
-		panic("sys_page_map: %e", r);
-	if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW)) < 0)
-		panic("sys_page_map: %e", r);
-	return r;
-#line 135 "../lib/fork.c"
-}
-
-//
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then let the kernel
+// create the child: sys_fork copies our address space copy-on-write,
+// gives the child its own exception stack and our page fault upcall,
+// and marks it runnable, all in one trap.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
-// It is also OK to panic on error.
-//
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
 fork(void)
 {
-#line 157 "../lib/fork.c"
 	envid_t envid;
-	int pn, end_pn, r;
 
 	set_pgfault_handler(pgfault);
 
-	// Create a child.
-	envid = sys_exofork();
-	if (envid < 0)
-		return envid;
-	if (envid == 0) {
+	envid = sys_fork();
+	if (envid == 0)
 		thisenv = &envs[ENVX(sys_getenvid())];
-		return 0;
-	}
-
-	// Copy the address space.
-	for (pn = 0; pn < PGNUM(UTOP); ) {
-		if (!(uvpde[pn >> 18] & PTE_P && uvpd[pn >> 9] & PTE_P)) {
-			pn += NPTENTRIES;
-			continue;
-		}
-		for (end_pn = pn + NPTENTRIES; pn < end_pn; pn++) {
-			if ((uvpt[pn] & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
-				continue;
-			if (pn == PPN(UXSTACKTOP - 1))
-				continue;
-			duppage(envid, pn);
-		}
-	}
-
-	// The child needs to start out with a valid exception stack.
-	if ((r = sys_page_alloc(envid, (void*) (UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
-		panic("allocating exception stack: %e", r);
-
-	// Copy the user-mode exception entrypoint.
-	if ((r = sys_env_set_pgfault_upcall(envid, thisenv->env_pgfault_upcall)) < 0)
-		panic("sys_env_set_pgfault_upcall: %e", r);
-
-
-	// Okay, the child is ready for life on its own.
-	if ((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
-		panic("sys_env_set_status: %e", r);
-
 	return envid;
-#line 204 "../lib/fork.c"
 }
 
 // Challenge!
@@ -47,7 +47,9 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
+// This function keeps trying until it succeeds.  The kernel queues
+// messages for an environment that isn't receiving, so it only has to
+// retry while toenv's queue is full.
 // It should panic() on any error other than -E_IPC_NOT_RECV.
 //
 // Hint:
@@ -68,6 +70,58 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		panic("error in ipc_send: %e", r);
 }
 
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply, like ipc_send followed by ipc_recv, except that
+// only 'to_env' may send the reply.  The kernel runs 'to_env' directly
+// on this CPU, so a call to a waiting server skips the scheduler.
+// 'rcv_pg' and 'perm_store' are as for ipc_recv.
+// Returns the reply's value.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*) UTOP;
+	if (!rcv_pg)
+		rcv_pg = (void*) UTOP;
+	while ((r = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r < 0)
+		panic("error in ipc_call: %e", r);
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// For servers answering ipc_call: send 'val' (and 'pg' with 'perm')
+// back to 'to_env', unless it is 0, then wait for the next request and
+// return it as ipc_recv does.  A client that has gone away gets no
+// reply.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*) UTOP;
+	if (!rcv_pg)
+		rcv_pg = (void*) UTOP;
+	while ((r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg)) == -E_IPC_NOT_RECV)
+		sys_yield();
+	if (r == -E_BAD_ENV)
+		return ipc_recv(from_env_store, rcv_pg, perm_store);
+	if (r < 0)
+		panic("error in ipc_reply_wait: %e", r);
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
 #ifdef VMM_GUEST
 
 // Access to host IPC interface through VMCALL.
@@ -15,6 +15,9 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ * Runs of several such pages are reserved as a demand-zero
+ * region instead (see sys_region_reserve), so they cost no
+ * memory until they are touched; the region marks them.
  */
 enum
 {
@@ -27,6 +30,20 @@ static uint8_t *mbegin = (uint8_t*) 0x08000000;
 static uint8_t *mend   = (uint8_t*) 0x10000000;
 static uint8_t *mptr;
 
+/*
+ * return the demand-zero region containing va, or 0.
+ */
+static const volatile struct EnvRegion *
+region(uintptr_t va)
+{
+	const volatile struct EnvRegion *er;
+
+	for (er = thisenv->env_regions; er < thisenv->env_regions + ENV_NREGION; er++)
+		if (va >= er->er_start && va < er->er_end)
+			return er;
+	return 0;
+}
+
 static int
 isfree(void *v, size_t n)
 {
@@ -34,7 +51,8 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[VPD(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P))
+		    || region(va))
 			return 0;
 	return 1;
 }
@@ -95,12 +113,21 @@ malloc(size_t n)
 
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * all but the last page may be left to demand-zero.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
+	i = 0;
+	if (n + 4 > 2 * PGSIZE
+	    && sys_region_reserve(mptr, ROUNDDOWN(n + 3, PGSIZE),
+				  PTE_P|PTE_U|PTE_W) == 0)
+		i = ROUNDDOWN(n + 3, PGSIZE);
+	for (; i < n + 4; i += PGSIZE){
 		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
 		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
+			if (region((uintptr_t) mptr))
+				sys_region_reserve(mptr, i, 0);
+			else
+				for (; i >= 0; i -= PGSIZE)
+					sys_page_unmap(0, mptr + i);
 			return 0;	/* out of physical memory */
 		}
 	}
@@ -115,6 +142,7 @@ malloc(size_t n)
 void
 free(void *v)
 {
+	const volatile struct EnvRegion *er;
 	uint8_t *c;
 	uint32_t *ref;
 
@@ -124,6 +152,11 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
+	if ((er = region((uintptr_t) c))) {
+		c = (uint8_t *) er->er_end;
+		sys_region_reserve((void *) er->er_start,
+				   er->er_end - er->er_start, 0);
+	}
 	while (uvpt[PGNUM(c)] & PTE_CONTINUED) {
 		sys_page_unmap(0, c);
 		c += PGSIZE;
@@ -13,21 +13,35 @@ union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 // The request body should be in nsipcbuf, and parts of the response
 // may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// len: bytes of nsipcbuf the request and its response use; the pages
+//	covering them (at least one) are granted to the network server.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nsipc_len(unsigned type, size_t len)
 {
 	static envid_t nsenv;
+	int npages;
+
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
-	static_assert(sizeof(nsipcbuf) == PGSIZE);
+	static_assert(sizeof(nsipcbuf) == NSIPC_SIZE);
+	static_assert(NSIPC_NPAGES <= IPC_MAXPAGES);
 
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	npages = MAX(ROUNDUP(len, PGSIZE) / PGSIZE, 1);
+
+	return ipc_call(nsenv, type, &nsipcbuf,
+			PTE_P|PTE_W|PTE_U|IPC_NPAGES(npages), NULL, NULL);
+}
+
+// nsipc_len for requests that fit in a page.
+static int
+nsipc(unsigned type)
+{
+	return nsipc_len(type, PGSIZE);
 }
 
 int
@@ -90,12 +104,13 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
 	int r;
 
+	len = MIN(len, (int) sizeof(nsipcbuf));
 	nsipcbuf.recv.req_s = s;
 	nsipcbuf.recv.req_len = len;
 	nsipcbuf.recv.req_flags = flags;
 
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
+	if ((r = nsipc_len(NSREQ_RECV, len)) >= 0) {
+		assert(r <= len);
 		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
 	}
 
@@ -105,12 +120,15 @@ nsipc_recv(int s, void *mem, int len, unsigned int flags)
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
+	// Like write, send may send fewer bytes than asked.
+	size = MIN(size, (int) (sizeof(nsipcbuf) -
+				offsetof(struct Nsreq_send, req_buf)));
 	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
 	memmove(&nsipcbuf.send.req_buf, buf, size);
 	nsipcbuf.send.req_size = size;
 	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	return nsipc_len(NSREQ_SEND,
+			 offsetof(struct Nsreq_send, req_buf) + size);
 }
 
 int
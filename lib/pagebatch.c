@@ -0,0 +1,41 @@
+// Queue page-mapping operations and apply them with as few
+// sys_page_batch traps as possible.
+
+#include <inc/lib.h>
+
+// Queue one operation on 'b', flushing the batch first if it is full.
+// Returns 0, or the error from that flush.
+int
+pagebatch_add(struct PageBatch *b, int op, envid_t srcenv, void *srcva,
+	      envid_t dstenv, void *dstva, int perm)
+{
+	struct PageOp *o;
+	int r;
+
+	if (b->n == PAGEOP_MAX && (r = pagebatch_flush(b)) < 0)
+		return r;
+	o = &b->ops[b->n++];
+	o->op = op;
+	o->srcenv = srcenv;
+	o->srcva = srcva;
+	o->dstenv = dstenv;
+	o->dstva = dstva;
+	o->perm = perm;
+	o->status = 0;
+	return 0;
+}
+
+// Apply every queued operation on 'b' and empty it.
+// Returns 0, or the status of the first operation that failed.
+int
+pagebatch_flush(struct PageBatch *b)
+{
+	int n = b->n, r;
+
+	b->n = 0;
+	if (n == 0)
+		return 0;
+	if ((r = sys_page_batch(b->ops, n)) < 0)
+		return r;
+	return r < n ? b->ops[r].status : 0;
+}
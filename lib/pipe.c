@@ -27,9 +27,32 @@ struct Dev devpipe =
 struct Pipe {
 	off_t p_rpos;		// read position
 	off_t p_wpos;		// write position
+	uint32_t p_waiters;	// envs blocked in pipe_wait
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
 };
 
+// A pipe end closed by an env that was killed, rather than one that
+// called close, wakes nobody; waiters look again this often.
+#define PIPE_RECHECK_MSEC	50
+
+// Block until *pos moves on from 'seen', the other end closes, or
+// PIPE_RECHECK_MSEC passes.
+static void
+pipe_wait(struct Pipe *p, off_t *pos, off_t seen)
+{
+	__sync_fetch_and_add(&p->p_waiters, 1);
+	sys_futex_wait((uint32_t *) pos, seen, PIPE_RECHECK_MSEC);
+	__sync_fetch_and_sub(&p->p_waiters, 1);
+}
+
+// Wake the envs waiting for *pos to move.
+static void
+pipe_wake(struct Pipe *p, off_t *pos)
+{
+	if (p->p_waiters)
+		sys_futex_wake((uint32_t *) pos, NENV);
+}
+
 int
 pipe(int pfd[2])
 {
@@ -131,20 +154,22 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			// pipe is empty
 			// if we got any data, return it
 			if (i > 0)
-				return i;
+				goto out;
 			// if all the writers are gone, note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// sleep until a writer moves p_wpos
 			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+				cprintf("devpipe_read wait\n");
+			pipe_wait(p, &p->p_wpos, p->p_rpos);
 		}
 		// there's a byte.  take it.
 		// wait to increment rpos until the byte is taken!
 		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
 		p->p_rpos++;
 	}
+out:
+	pipe_wake(p, &p->p_rpos);
 	return i;
 #line 178 "../lib/pipe.c"
 }
@@ -171,10 +196,12 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
+			// let readers at what we wrote so far, then sleep
+			// until one of them moves p_rpos
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wake(p, &p->p_wpos);
+			pipe_wait(p, &p->p_rpos, p->p_wpos - sizeof(p->p_buf));
 		}
 		// there's room for a byte.  store it.
 		// wait to increment wpos until the byte is stored!
@@ -182,6 +209,7 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		p->p_wpos++;
 	}
 
+	pipe_wake(p, &p->p_wpos);
 	return i;
 #line 226 "../lib/pipe.c"
 }
@@ -201,8 +229,13 @@ static int
 devpipe_close(struct Fd *fd)
 {
 #line 243 "../lib/pipe.c"
+	struct Pipe *p = (struct Pipe *) fd2data(fd);
+
 	(void) sys_page_unmap(0, fd);
+	// Let the other end notice, usually once we are done here.
+	pipe_wake(p, &p->p_rpos);
+	pipe_wake(p, &p->p_wpos);
 #line 245 "../lib/pipe.c"
-	return sys_page_unmap(0, fd2data(fd));
+	return sys_page_unmap(0, p);
 }
 
@@ -0,0 +1,91 @@
+// Queue system calls in a ring that the kernel runs on this
+// environment's next system call (see sys_ring_setup), so a batch of
+// independent calls costs one trap, or none if the environment makes
+// some other system call before it needs the results.
+
+#include <inc/lib.h>
+
+#define barrier()	__asm __volatile("" : : : "memory")
+
+static struct SysRing ring __attribute__((aligned(PGSIZE)));
+static envid_t ring_owner;
+
+// Register the ring the first time this environment uses it.  A forked
+// child inherits a copy of its parent's ring, which the kernel doesn't
+// run for it, so the child starts over with an empty one.
+static int
+ring_init(void)
+{
+	int r;
+
+	if (ring_owner == thisenv->env_id)
+		return 0;
+	ring.sr_sq_head = ring.sr_sq_tail = 0;
+	ring.sr_cq_head = ring.sr_cq_tail = 0;
+	if ((r = sys_ring_setup(&ring)) < 0)
+		return r;
+	ring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Queue system call 'syscallno' with arguments a1 to a5, as the kernel's
+// syscall() takes them.  'data' comes back in the call's completion.
+// If the queue is full, runs the queued calls first with
+// sys_ring_enter.
+// Returns 0, -E_AGAIN if completions must be reaped before more calls
+// can run, or another error from sys_ring_setup.
+int
+ring_submit(uint64_t data, int syscallno, uint64_t a1, uint64_t a2,
+	    uint64_t a3, uint64_t a4, uint64_t a5)
+{
+	struct RingSqe *sqe;
+	int r;
+
+	if ((r = ring_init()) < 0)
+		return r;
+	if (ring.sr_sq_tail - ring.sr_sq_head == RING_NSQE) {
+		if ((r = sys_ring_enter()) < 0)
+			return r;
+		if (ring.sr_sq_tail - ring.sr_sq_head == RING_NSQE)
+			return -E_AGAIN;
+	}
+	sqe = &ring.sr_sq[ring.sr_sq_tail % RING_NSQE];
+	sqe->sqe_data = data;
+	sqe->sqe_syscallno = syscallno;
+	sqe->sqe_args[0] = a1;
+	sqe->sqe_args[1] = a2;
+	sqe->sqe_args[2] = a3;
+	sqe->sqe_args[3] = a4;
+	sqe->sqe_args[4] = a5;
+	// Any interrupt may run the queue, so the entry must be complete
+	// before the kernel can see it.
+	barrier();
+	ring.sr_sq_tail++;
+	return 0;
+}
+
+// Run the queued calls now.
+// Returns the number of completions waiting to be reaped, or < 0 on
+// error.
+int
+ring_enter(void)
+{
+	int r;
+
+	if ((r = ring_init()) < 0)
+		return r;
+	return sys_ring_enter();
+}
+
+// Take the oldest completion into *cqe.
+// Returns false if no call has completed yet.
+bool
+ring_reap(struct RingCqe *cqe)
+{
+	if (ring_init() < 0 || ring.sr_cq_head == ring.sr_cq_tail)
+		return 0;
+	*cqe = ring.sr_cq[ring.sr_cq_head % RING_NCQE];
+	barrier();
+	ring.sr_cq_head++;
+	return 1;
+}
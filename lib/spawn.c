@@ -6,6 +6,13 @@
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
 
+// Number of file pages map_segment stages at UTEMP per round trip;
+// each needs a map and an unmap entry in one batch.
+#define SPAWN_STAGE		(PAGEOP_MAX / 2)
+
+// Page operations queued for the child, applied with sys_page_batch.
+static struct PageBatch batch;
+
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -268,8 +275,7 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	    int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, k, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -280,25 +286,46 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+	// Pages backed by the file are read through a staging area at
+	// UTEMP, SPAWN_STAGE pages at a time: one batch to allocate the
+	// staging pages, and one to move them all into the child.
+	for (i = 0; i < memsz && i < filesz; i += n * PGSIZE) {
+		n = MIN(SPAWN_STAGE, (ROUNDUP(MIN(memsz, filesz), PGSIZE) - i) / PGSIZE);
+		for (k = 0; k < n; k++)
+			if ((r = pagebatch_add(&batch, PAGEOP_ALLOC, 0, 0,
+					       0, UTEMP + k * PGSIZE,
+					       PTE_P|PTE_U|PTE_W)) < 0)
+				goto error;
+		if ((r = pagebatch_flush(&batch)) < 0)
+			goto error;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			goto error;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			goto error;
+		for (k = 0; k < n; k++) {
+			pagebatch_add(&batch, PAGEOP_MAP, 0, UTEMP + k * PGSIZE,
+				      child, (void*) (va + i + k * PGSIZE), perm);
+			pagebatch_add(&batch, PAGEOP_UNMAP, 0, 0,
+				      0, UTEMP + k * PGSIZE, 0);
 		}
+		if ((r = pagebatch_flush(&batch)) < 0)
+			panic("spawn: sys_page_map data: %e", r);
 	}
-	return 0;
+
+	// The rest of the segment is blank pages.
+	for (; i < memsz; i += PGSIZE)
+		if ((r = pagebatch_add(&batch, PAGEOP_ALLOC, 0, 0,
+				       child, (void*) (va + i), perm)) < 0)
+			return r;
+	return pagebatch_flush(&batch);
+
+error:
+	// Some of the staging pages may already be allocated.
+	for (k = 0; k < SPAWN_STAGE; k++)
+		pagebatch_add(&batch, PAGEOP_UNMAP, 0, 0,
+			      0, UTEMP + k * PGSIZE, 0);
+	pagebatch_flush(&batch);
+	return r;
 }
 
 #line 305 "../lib/spawn.c"
@@ -311,20 +338,24 @@ copy_shared_pages(envid_t child)
 	void* va;
 
 	for (pn = 0; pn < PGNUM(UTOP); ) {
-		if (!(uvpde[pn>>18] & PTE_P && uvpd[pn >> 9] & PTE_P))
+		// Large pages have no page table to read through uvpt,
+		// and are never shared.
+		if (!(uvpde[pn>>18] & PTE_P && uvpd[pn >> 9] & PTE_P)
+		    || (uvpd[pn >> 9] & PTE_PS))
 			pn += NPTENTRIES;
 		else {
 			last_pn = pn + NPTENTRIES;
 			for (; pn < last_pn; pn++)
 				if ((uvpt[pn] & (PTE_P | PTE_SHARE)) == (PTE_P | PTE_SHARE)) {
 					va = (void*) (pn << PGSHIFT);
-					if ((r = sys_page_map(0, va, child, va, uvpt[pn] & PTE_SYSCALL)) < 0)
+					if ((r = pagebatch_add(&batch, PAGEOP_MAP, 0, va,
+							       child, va, uvpt[pn] & PTE_SYSCALL)) < 0)
 						return r;
 				}
 		}
 	}
 #line 329 "../lib/spawn.c"
-	return 0;
+	return pagebatch_flush(&batch);
 }
 #line 332 "../lib/spawn.c"
 
@@ -0,0 +1,127 @@
+// Mutexes, condition variables and semaphores that block in the
+// kernel with sys_futex_wait instead of spinning on sys_yield.  The
+// uncontended paths are a single atomic instruction, with no system
+// call.
+
+#include <inc/lib.h>
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = __sync_val_compare_and_swap(&m->m_state, 0, 1)) == 0)
+		return;
+	// Mark the mutex contended, so that its holder wakes us when it
+	// unlocks, and sleep until we are the one to take it.
+	if (c != 2)
+		c = __sync_lock_test_and_set(&m->m_state, 2);
+	while (c != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		c = __sync_lock_test_and_set(&m->m_state, 2);
+	}
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (__sync_fetch_and_sub(&m->m_state, 1) != 1) {
+		m->m_state = 0;
+		sys_futex_wake(&m->m_state, 1);
+	}
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+// Release m, wait for c to be signalled (or a spurious wakeup) and
+// take m again.  With a non-zero msec, give up after that many
+// milliseconds and return -E_TIMEOUT.
+int
+cond_timedwait(struct Cond *c, struct Mutex *m, unsigned int msec)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	mutex_unlock(m);
+	r = sys_futex_wait(&c->c_seq, seq, msec);
+	mutex_lock(m);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_wait(struct Cond *c, struct Mutex *m)
+{
+	cond_timedwait(c, m, 0);
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	__sync_fetch_and_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	__sync_fetch_and_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, NENV);
+}
+
+void
+sem_init(struct Sem *s, uint32_t count)
+{
+	s->s_count = count;
+	s->s_waiters = 0;
+}
+
+// Take one unit of s, waiting for sem_post if there is none.  With a
+// non-zero msec, give up after that many milliseconds and return
+// -E_TIMEOUT.
+int
+sem_timedwait(struct Sem *s, unsigned int msec)
+{
+	unsigned int deadline = time_msec() + msec, now;
+	uint32_t c;
+
+	for (;;) {
+		c = s->s_count;
+		if (c > 0) {
+			if (__sync_bool_compare_and_swap(&s->s_count, c, c - 1))
+				return 0;
+			continue;
+		}
+		now = time_msec();
+		if (msec && now >= deadline)
+			return -E_TIMEOUT;
+		// sem_post checks s_waiters after bumping s_count, so
+		// either it sees us or the kernel sees s_count != 0.
+		__sync_fetch_and_add(&s->s_waiters, 1);
+		sys_futex_wait(&s->s_count, 0, msec ? deadline - now : 0);
+		__sync_fetch_and_sub(&s->s_waiters, 1);
+	}
+}
+
+void
+sem_wait(struct Sem *s)
+{
+	sem_timedwait(s, 0);
+}
+
+void
+sem_post(struct Sem *s)
+{
+	__sync_fetch_and_add(&s->s_count, 1);
+	if (s->s_waiters)
+		sys_futex_wake(&s->s_count, 1);
+}
@@ -11,7 +11,8 @@ syscall(int num, int check, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
-	// Interrupt kernel with T_SYSCALL.
+	// Interrupt kernel with T_SYSCALL, or enter it with SYSCALL
+	// (see below).
 	//
 	// The "volatile" tells the assembler not to optimize
 	// this instruction away just because we don't use the
@@ -21,6 +22,22 @@ syscall(int num, int check, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 	// potentially change the condition codes and arbitrary
 	// memory locations.
 
+#ifndef VMM_GUEST
+	// The fast path is the SYSCALL instruction.  It clobbers CX and
+	// R11, so the second parameter goes in R10 instead of CX.
+	register uint64_t r10 asm("r10") = a2;
+
+	asm volatile("syscall\n"
+		     : "=a" (ret)
+		     : "a" (num),
+		       "d" (a1),
+		       "r" (r10),
+		       "b" (a3),
+		       "D" (a4),
+		       "S" (a5)
+		     : "rcx", "r11", "cc", "memory");
+#else
+	// Guest kernels don't set up SYSCALL; trap in the old way.
 	asm volatile("int %1\n"
 		     : "=a" (ret)
 		     : "i" (T_SYSCALL),
@@ -31,6 +48,7 @@ syscall(int num, int check, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4,
 		       "D" (a4),
 		       "S" (a5)
 		     : "cc", "memory");
+#endif
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -87,8 +105,20 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint64_t) va, 0, 0, 0);
 }
 
+int
+sys_page_batch(struct PageOp *ops, int n)
+{
+	return syscall(SYS_page_batch, 0, (uint64_t) ops, n, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -121,12 +151,95 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint64_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint64_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint64_t) srcva, perm,
+		       (uint64_t) dstva);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint64_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, (uint64_t) srcva,
+		       perm, (uint64_t) dstva);
+}
+
+int
+sys_ipc_set_maxpages(int npages)
+{
+	return syscall(SYS_ipc_set_maxpages, 0, npages, 0, 0, 0, 0);
+}
+
+int
+sys_ring_setup(struct SysRing *ring)
+{
+	return syscall(SYS_ring_setup, 0, (uint64_t) ring, 0, 0, 0, 0);
+}
+
+int
+sys_ring_enter(void)
+{
+	return syscall(SYS_ring_enter, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_region_reserve(void *va, size_t len, int perm)
+{
+	return syscall(SYS_region_reserve, 1, (uint64_t) va, len, perm, 0, 0);
+}
+
 #line 125 "../lib/syscall.c"
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
+
+int
+sys_sleep_until(unsigned int msec)
+{
+	return syscall(SYS_sleep_until, 0, msec, 0, 0, 0, 0);
+}
+
+uint64_t
+sys_time_ns(void)
+{
+	return syscall(SYS_time_ns, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *va, uint32_t val, unsigned int timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint64_t) va, val, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(const volatile uint32_t *va, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint64_t) va, n, 0, 0, 0);
+}
+
+void
+sys_env_exit(int status)
+{
+	syscall(SYS_env_exit, 0, status, 0, 0, 0, 0);
+}
+
+// Block until child 'envid' exits and store its exit status in
+// *status (if status isn't null).
+int
+sys_env_wait(envid_t envid, int *status)
+{
+	int r;
+
+	while ((r = syscall(SYS_env_wait, 0, envid, 0, 0, 0, 0)) == -E_AGAIN)
+		;
+	if (r == 0 && status)
+		*status = thisenv->env_child_status;
+	return r;
+}
 #line 131 "../lib/syscall.c"
 
 int
@@ -0,0 +1,44 @@
+// Read the kernel's clock from the time page at UTIME, without
+// making a system call.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static const volatile struct TimePage *timepage =
+	(const volatile struct TimePage *) UTIME;
+
+// Milliseconds since boot, counted in timer ticks: the same clock as
+// sys_time_msec and the deadlines of sys_sleep_until.
+unsigned int
+time_msec(void)
+{
+	uint32_t seq;
+	uint64_t ticks;
+
+	do {
+		seq = timepage->tp_seq;
+		ticks = timepage->tp_ticks;
+	} while ((seq & 1) || seq != timepage->tp_seq);
+	return ticks * 1000 / timepage->tp_hz;
+}
+
+// Nanoseconds since boot, at the TSC's resolution: the same clock as
+// sys_time_ns.
+uint64_t
+time_ns(void)
+{
+	uint32_t seq;
+	uint64_t ticks, hz, d;
+
+	do {
+		seq = timepage->tp_seq;
+		ticks = timepage->tp_ticks;
+		hz = timepage->tp_tsc_hz;
+		d = read_tsc() - timepage->tp_tsc_base;
+	} while ((seq & 1) || seq != timepage->tp_seq);
+
+	if (!hz)
+		return ticks * (1000000000 / timepage->tp_hz);
+	// Split d so that d * 10^9 can't overflow.
+	return d / hz * 1000000000 + d % hz * 1000000000 / hz;
+}
@@ -1,14 +1,21 @@
 #line 2 "../lib/wait.c"
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
+// How long to sleep before looking at 'envid' again even without a
+// wakeup.  That only matters if envid's slot was freed and reused with
+// the same status between our reading it and the kernel checking it.
+#define WAIT_RECHECK_MSEC	100
+
+// Waits until 'envid' exits.  The kernel wakes futex waiters on an
+// environment's env_status when it frees the environment.
 void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	unsigned status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		sys_futex_wait(&e->env_status, status, WAIT_RECHECK_MSEC);
 }
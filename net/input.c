@@ -1,25 +1,30 @@
 #line 2 "../net/input.c"
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+struct Chan input_chan;
 
     void
 input(envid_t ns_envid)
 {
+    struct jif_pkt *pkt;
+
     binaryname = "ns_input";
+    chan_attach(&input_chan, ns_envid, NSREQ_INPUT);
 #line 11 "../net/input.c"
     while (1) {
         int r;
-        if ((r = sys_page_alloc(0, &nsipcbuf, PTE_P|PTE_U|PTE_W)) < 0)
-            panic("sys_page_alloc: %e", r);
-        r = sys_net_receive(nsipcbuf.pkt.jp_data, 1518);
+        // Receive straight into the next slot.  If the ring is full,
+        // the network server is behind, so let it run.
+        while (!(pkt = chan_write_slot(&input_chan)))
+            sys_yield();
+        r = sys_net_receive(pkt->jp_data, 1518);
         if (r == 0) {
             sys_yield();
         } else if (r < 0) {
             cprintf("Failed to receive packet: %e\n", r);
         } else if (r > 0) {
-            nsipcbuf.pkt.jp_len = r;
-            ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_U|PTE_P);
+            pkt->jp_len = r;
+            chan_write_commit(&input_chan);
         }
     }
 #line 26 "../net/input.c"
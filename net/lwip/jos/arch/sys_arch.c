@@ -182,7 +182,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
  	} else if (tm_msec == SYS_ARCH_NOWAIT) {
 	    return SYS_ARCH_TIMEOUT;
 	} else {
-	    uint32_t a = sys_time_msec();
+	    uint32_t a = time_msec();
 	    uint32_t sleep_until = tm_msec ? a + (tm_msec - waited) : ~0;
 	    sems[sem].waiters = 1;
 	    uint32_t cur_v = sems[sem].v;
@@ -193,7 +193,7 @@ sys_arch_sem_wait(sys_sem_t sem, u32_t tm_msec)
 		cprintf("sys_arch_sem_wait: sem freed under waiter!\n");
 		return SYS_ARCH_TIMEOUT;
 	    }
-	    uint32_t b = sys_time_msec();
+	    uint32_t b = time_msec();
 	    waited += (b - a);
 	}
     }
@@ -32,12 +32,37 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// If every other thread is blocked in thread_wait as well, nothing in
+// this environment can end the current thread's wait before some
+// thread's deadline: return the earliest one, so the caller can sleep
+// in the kernel until then.  Return 0 if some thread can run now.
+static uint32_t
+thread_idle_until(uint32_t now)
+{
+    struct thread_context *tc;
+    uint32_t until = cur_tc->tc_wait_until;
+
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link) {
+	if (!tc->tc_waiting || tc->tc_wakeup || tc->tc_wait_until <= now)
+	    return 0;
+	if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	    return 0;
+	if (tc->tc_wait_until < until)
+	    until = tc->tc_wait_until;
+    }
+    return until;
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
-    uint32_t s = sys_time_msec();
+    uint32_t s = time_msec();
     uint32_t p = s;
+    uint32_t until;
 
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_until = msec;
+    cur_tc->tc_waiting = 1;
     cur_tc->tc_wakeup = 0;
 
     while (p < msec) {
@@ -48,11 +73,15 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
-	p = sys_time_msec();
+	if ((until = thread_idle_until(p)))
+	    sys_sleep_until(until);
+	else
+	    thread_yield();
+	p = time_msec();
     }
 
     cur_tc->tc_wait_addr = 0;
+    cur_tc->tc_waiting = 0;
     cur_tc->tc_wakeup = 0;
 }
 
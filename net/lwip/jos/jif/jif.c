@@ -45,11 +45,9 @@
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
-
 struct jif {
     struct eth_addr *ethaddr;
-    envid_t envid;
+    struct Chan *chan;		// Packet channel to the output environment
 };
 
 static void
@@ -81,14 +79,15 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-
     struct jif *jif;
     jif = netif->state;
 
+    // Wait for the output environment to free a slot.
+    struct jif_pkt *pkt;
+    while (!(pkt = chan_write_slot(jif->chan)))
+	sys_yield();
+    int maxsize = jif->chan->ch_ring->cr_slotsize - sizeof(*pkt);
+
     char *txbuf = pkt->jp_data;
     int txsize = 0;
     struct pbuf *q;
@@ -97,7 +96,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
 	   time. The size of the data in each pbuf is kept in the ->len
 	   variable. */
 
-	if (txsize + q->len > 2000)
+	if (txsize + q->len > maxsize)
 	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
 	memcpy(&txbuf[txsize], q->payload, q->len);
 	txsize += q->len;
@@ -105,8 +104,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
     pkt->jp_len = txsize;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    chan_write_commit(jif->chan);
 
     return ERR_OK;
 }
@@ -223,7 +221,7 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
+    struct Chan *output_chan;
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -232,7 +230,7 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
+    output_chan = (struct Chan *)netif->state;
 
     netif->state = jif;
     netif->output = jif_output;
@@ -240,7 +238,7 @@ jif_init(struct netif *netif)
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
+    jif->chan = output_chan;
 
     low_level_init(netif);
 
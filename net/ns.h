@@ -10,14 +10,24 @@
 
 // Virtual address at which to receive page mappings containing client requests.
 #define QUEUE_SIZE	20
-#define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
+#define REQVA		(0x0ffff000 - QUEUE_SIZE * NSIPC_SIZE)
+
+// Packet channels from the input environment to the network server, and
+// from the network server to the output environment.  Each slot holds a
+// struct jif_pkt.  Create both before forking input and output.
+#define NSCHAN_NSLOTS	32
+#define NSCHAN_SLOTSIZE	2048
+#define INPUT_CHANVA	0x10000000
+#define OUTPUT_CHANVA	0x10100000
 
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
 /* input.c */
+extern struct Chan input_chan;
 void input(envid_t ns_envid);
 
 /* output.c */
+extern struct Chan output_chan;
 void output(envid_t ns_envid);
 
@@ -1,7 +1,7 @@
 #line 2 "../net/output.c"
 #include "ns.h"
 
-extern union Nsipc nsipcbuf;
+struct Chan output_chan;
 
     void
 output(envid_t ns_envid)
@@ -9,15 +9,18 @@ output(envid_t ns_envid)
     binaryname = "ns_output";
 
 #line 12 "../net/output.c"
+    struct jif_pkt *pkt;
     int r;
 
     while (1) {
-        int32_t req, whom;
-        req = ipc_recv(&whom, &nsipcbuf, NULL);
-        assert(whom == ns_envid);
-        assert(req == NSREQ_OUTPUT);
-        if ((r = sys_net_transmit(nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len)) < 0)
-            cprintf("Failed to transmit packet: %e\n", r);
+        // The network server only rings when we have drained the
+        // ring, so a burst of packets costs one IPC.
+        chan_wait(&output_chan);
+        while ((pkt = chan_read_slot(&output_chan))) {
+            if ((r = sys_net_transmit(pkt->jp_data, pkt->jp_len)) < 0)
+                cprintf("Failed to transmit packet: %e\n", r);
+            chan_read_done(&output_chan);
+        }
     }
 #line 27 "../net/output.c"
 }
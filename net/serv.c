@@ -65,7 +65,7 @@ get_buffer(void) {
         return 0;
     }
 
-    va = (void *)(REQVA + i * PGSIZE);
+    va = (void *)(REQVA + i * NSIPC_SIZE);
     buse[i] = 1;
 
     return va;
@@ -73,7 +73,7 @@ get_buffer(void) {
 
 static void
 put_buffer(void *va) {
-    int64_t i = ((uint64_t)va - REQVA) / PGSIZE;
+    int64_t i = ((uint64_t)va - REQVA) / NSIPC_SIZE;
     buse[i] = 0;
 }
 
@@ -102,7 +102,7 @@ net_timer(uint64_t arg)
     struct timer_thread *t = (struct timer_thread *) arg;
 
     for (;;) {
-        uint32_t cur = sys_time_msec();
+        uint32_t cur = time_msec();
 
         lwip_core_lock();
         t->func();
@@ -143,7 +143,7 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
     thread_wait(&done, 0, (uint32_t)~0);
     lwip_core_lock();
 
-    lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+    lwip_init(&nif, &output_chan, ipaddr, netmask, gw);
 
     start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
     start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -170,25 +170,45 @@ process_timer(envid_t envid) {
         return;
     }
 
-    start = sys_time_msec();
+    start = time_msec();
     thread_yield();
-    now = sys_time_msec();
+    now = time_msec();
 
     to = TIMER_INTERVAL - (now - start);
     ipc_send(envid, to, 0, 0);
 }
 
+static void
+process_input(envid_t envid) {
+    struct jif_pkt *pkt;
+
+    if (envid != input_envid) {
+        cprintf("NS: received input doorbell from envid %x not input env\n", envid);
+        return;
+    }
+
+    // Drain the ring, then ask for the next doorbell before going back
+    // to ipc_recv.  If a packet slipped in meanwhile, drain it too.
+    do {
+        while ((pkt = chan_read_slot(&input_chan))) {
+            jif_input(&nif, pkt);
+            chan_read_done(&input_chan);
+        }
+    } while (!chan_arm(&input_chan));
+}
+
 struct st_args {
     int32_t reqno;
     uint32_t whom;
     union Nsipc *req;
+    size_t size;        // Bytes of req the client mapped
 };
 
 static void
 serve_thread(uint64_t a) {
     struct st_args *args = (struct st_args *)a;
     union Nsipc *req = args->req;
-    int r;
+    int r, i;
 
     switch (args->reqno) {
         case NSREQ_ACCEPT:
@@ -220,20 +240,19 @@ serve_thread(uint64_t a) {
             // Note that we read the request fields before we
             // overwrite it with the response data.
             r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-                    req->recv.req_len, req->recv.req_flags);
+                    MIN(req->recv.req_len, (int) args->size),
+                    req->recv.req_flags);
             break;
         case NSREQ_SEND:
             r = lwip_send(req->send.req_s, &req->send.req_buf,
-                    req->send.req_size, req->send.req_flags);
+                    MIN(req->send.req_size, (int) (args->size -
+                        offsetof(struct Nsreq_send, req_buf))),
+                    req->send.req_flags);
             break;
         case NSREQ_SOCKET:
             r = lwip_socket(req->socket.req_domain, req->socket.req_type,
                     req->socket.req_protocol);
             break;
-        case NSREQ_INPUT:
-            jif_input(&nif, (void *)&req->pkt);
-            r = 0;
-            break;
         default:
             cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
             r = -E_INVAL;
@@ -246,11 +265,11 @@ serve_thread(uint64_t a) {
         perror(buf);
     }
 
-    if (args->reqno != NSREQ_INPUT)
-        ipc_send(args->whom, r, 0, 0);
+    ipc_send(args->whom, r, 0, 0);
 
     put_buffer(args->req);
-    sys_page_unmap(0, (void*) args->req);
+    for (i = 0; i < args->size / PGSIZE; i++)
+        sys_page_unmap(0, (char *) args->req + i * PGSIZE);
     free(args);
 }
 
@@ -261,6 +280,10 @@ serve(void) {
     int i, perm;
     void *va;
 
+    // Sends and recvs come with up to NSIPC_NPAGES pages.
+    if ((i = sys_ipc_set_maxpages(NSIPC_NPAGES)) < 0)
+        panic("sys_ipc_set_maxpages: %e", i);
+
     while (1) {
         // ipc_recv will block the entire process, so we flush
         // all pending work from other threads.  We limit the
@@ -281,6 +304,11 @@ serve(void) {
             put_buffer(va);
             continue;
         }
+        if (reqno == NSREQ_INPUT) {
+            process_input(whom);
+            put_buffer(va);
+            continue;
+        }
 
         // All remaining requests must contain an argument page
         if (!(perm & PTE_P)) {
@@ -297,6 +325,7 @@ serve(void) {
         args->reqno = reqno;
         args->whom = whom;
         args->req = va;
+        args->size = thisenv->env_ipc_npages * PGSIZE;
 
         thread_create(0, "serve_thread", serve_thread, (uint64_t)args);
         thread_yield(); // let the thread created run
@@ -315,9 +344,19 @@ tmain(uint64_t arg) {
 umain(int argc, char **argv)
 {
     envid_t ns_envid = sys_getenvid();
+    int r;
 
     binaryname = "ns";
 
+    // Packets move through shared rings, which the input and output
+    // environments inherit when they fork.
+    if ((r = chan_create(&input_chan, (void *) INPUT_CHANVA,
+                    NSCHAN_NSLOTS, NSCHAN_SLOTSIZE)) < 0)
+        panic("chan_create: %e", r);
+    if ((r = chan_create(&output_chan, (void *) OUTPUT_CHANVA,
+                    NSCHAN_NSLOTS, NSCHAN_SLOTSIZE)) < 0)
+        panic("chan_create: %e", r);
+
     // fork off the timer thread which will send us periodic messages
     timer_envid = fork();
     if (timer_envid < 0)
@@ -346,6 +385,7 @@ umain(int argc, char **argv)
         output(ns_envid);
         return;
     }
+    chan_attach(&output_chan, output_envid, NSREQ_OUTPUT);
 
     // lwIP requires a user threading library; start the library and jump
     // into a thread to continue initialization.
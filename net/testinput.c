@@ -5,8 +5,6 @@
 static envid_t output_envid;
 static envid_t input_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
-
 
     static void
 announce(void)
@@ -20,10 +18,10 @@ announce(void)
     uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
     uint32_t myip = inet_addr(IP);
     uint32_t gwip = inet_addr(DEFAULT);
-    int r;
+    struct jif_pkt *pkt;
 
-    if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-        panic("sys_page_map: %e", r);
+    while (!(pkt = chan_write_slot(&output_chan)))
+        sys_yield();
 
     struct etharp_hdr *arp = (struct etharp_hdr*)pkt->jp_data;
     pkt->jp_len = sizeof(*arp);
@@ -40,8 +38,7 @@ announce(void)
     memset(arp->dhwaddr.addr,  0x00,  ETHARP_HWADDR_LEN);
     memcpy(arp->dipaddr.addrw, &gwip, 4);
 
-    ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, pkt);
+    chan_write_commit(&output_chan);
 }
 
     static void
@@ -73,6 +70,13 @@ umain(int argc, char **argv)
 
     binaryname = "testinput";
 
+    if ((r = chan_create(&input_chan, (void *) INPUT_CHANVA,
+                    NSCHAN_NSLOTS, NSCHAN_SLOTSIZE)) < 0)
+        panic("chan_create: %e", r);
+    if ((r = chan_create(&output_chan, (void *) OUTPUT_CHANVA,
+                    NSCHAN_NSLOTS, NSCHAN_SLOTSIZE)) < 0)
+        panic("chan_create: %e", r);
+
     output_envid = fork();
     if (output_envid < 0)
         panic("error forking");
@@ -80,6 +84,7 @@ umain(int argc, char **argv)
         output(ns_envid);
         return;
     }
+    chan_attach(&output_chan, output_envid, NSREQ_OUTPUT);
 
     input_envid = fork();
     if (input_envid < 0)
@@ -94,23 +99,28 @@ umain(int argc, char **argv)
 
     while (1) {
         envid_t whom;
-        int perm;
-
-        int32_t req = ipc_recv((int32_t *)&whom, pkt, &perm);
-        if (req < 0)
-            panic("ipc_recv: %e", req);
-        if (whom != input_envid)
-            panic("IPC from unexpected environment %08x", whom);
-        if (req != NSREQ_INPUT)
-            panic("Unexpected IPC %d", req);
-
-        hexdump("input: ", pkt->jp_data, pkt->jp_len);
-        cprintf("\n");
-
-        // Only indicate that we're waiting for packets once
-        // we've received the ARP reply
-        if (first)
-            cprintf("Waiting for packets...\n");
-        first = 0;
+        struct jif_pkt *pkt;
+
+        if (chan_arm(&input_chan)) {
+            int32_t req = ipc_recv((int32_t *)&whom, 0, 0);
+            if (req < 0)
+                panic("ipc_recv: %e", req);
+            if (whom != input_envid)
+                panic("IPC from unexpected environment %08x", whom);
+            if (req != NSREQ_INPUT)
+                panic("Unexpected IPC %d", req);
+        }
+
+        while ((pkt = chan_read_slot(&input_chan))) {
+            hexdump("input: ", pkt->jp_data, pkt->jp_len);
+            cprintf("\n");
+            chan_read_done(&input_chan);
+
+            // Only indicate that we're waiting for packets once
+            // we've received the ARP reply
+            if (first)
+                cprintf("Waiting for packets...\n");
+            first = 0;
+        }
     }
 }
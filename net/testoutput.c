@@ -7,17 +7,20 @@
 
 static envid_t output_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
-
 
     void
 umain(int argc, char **argv)
 {
     envid_t ns_envid = sys_getenvid();
+    struct jif_pkt *pkt;
     int i, r;
 
     binaryname = "testoutput";
 
+    if ((r = chan_create(&output_chan, (void *) OUTPUT_CHANVA,
+                    NSCHAN_NSLOTS, NSCHAN_SLOTSIZE)) < 0)
+        panic("chan_create: %e", r);
+
     output_envid = fork();
     if (output_envid < 0)
         panic("error forking");
@@ -25,16 +28,16 @@ umain(int argc, char **argv)
         output(ns_envid);
         return;
     }
+    chan_attach(&output_chan, output_envid, NSREQ_OUTPUT);
 
     for (i = 0; i < TESTOUTPUT_COUNT; i++) {
-        if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-            panic("sys_page_alloc: %e", r);
+        while (!(pkt = chan_write_slot(&output_chan)))
+            sys_yield();
         pkt->jp_len = snprintf(pkt->jp_data,
-                PGSIZE - sizeof(pkt->jp_len),
+                NSCHAN_SLOTSIZE - sizeof(pkt->jp_len),
                 "Packet %02d", i);
         cprintf("Transmitting packet %d\n", i);
-        ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-        sys_page_unmap(0, pkt);
+        chan_write_commit(&output_chan);
     }
 
     // Spin for a while, just in case IPC's or packets need to be flushed
@@ -3,17 +3,14 @@
 
 void
 timer(envid_t ns_envid, uint32_t initial_to) {
-    int r;
-    uint32_t stop = sys_time_msec() + initial_to;
+    uint32_t stop = time_msec() + initial_to;
 
     binaryname = "ns_timer";
 
     while (1) {
-        while((r = sys_time_msec()) < stop && r >= 0) {
-            sys_yield();
+        while (time_msec() < stop) {
+            sys_sleep_until(stop);
         }
-        if (r < 0)
-            panic("sys_time_msec: %e", r);
 
         ipc_send(ns_envid, NSREQ_TIMER, 0, 0);
 
@@ -26,7 +23,7 @@ timer(envid_t ns_envid, uint32_t initial_to) {
                 continue;
             }
 
-            stop = sys_time_msec() + to;
+            stop = time_msec() + to;
             break;
         }
     }
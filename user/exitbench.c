@@ -0,0 +1,102 @@
+// Measure address-space teardown.  First, children map and dirty a
+// growing number of pages and exit; the time from the child's exit to
+// the parent's sys_env_wait returning is mostly env_free.  Then run
+// forktree, and a shell script that spawns NCMD commands, end to end:
+// until every environment they created has been freed.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NEXIT	8
+#define NCMD	32
+#define HEAP	((char *) 0x10000000)
+#define SHARED	((volatile uint64_t *) 0xA0000000)
+#define SCRIPT	"/exitbench.sh"
+
+static const int heap_pages[] = { 0, 1024, 4096 };
+
+static void
+exit_latency(int npages)
+{
+	envid_t who;
+	uint64_t cycles = 0;
+	int i, j, r;
+
+	for (i = 0; i < NEXIT; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			for (j = 0; j < npages; j++) {
+				if ((r = sys_page_alloc(0, HEAP + j * PGSIZE,
+							PTE_P|PTE_U|PTE_W)) < 0)
+					panic("sys_page_alloc: %e", r);
+				HEAP[j * PGSIZE] = 1;
+			}
+			*SHARED = read_tsc();
+			exit();
+		}
+		sys_env_wait(who, 0);
+		cycles += read_tsc() - *SHARED;
+	}
+	cprintf("exitbench: %d pages: %llu cycles from exit to wait\n",
+		npages, cycles / NEXIT);
+}
+
+// Return the number of environments that have not been freed.
+static int
+nenvs(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status != ENV_FREE)
+			n++;
+	return n;
+}
+
+static void
+run(const char *name, const char *prog, const char *arg)
+{
+	envid_t who;
+	uint64_t start_ns;
+	int base;
+
+	base = nenvs();
+	start_ns = time_ns();
+	if ((who = spawnl(prog, prog, arg, (char *) 0)) < 0)
+		panic("spawnl %s: %e", prog, who);
+	sys_env_wait(who, 0);
+	// forktree's root exits before its descendants do.
+	while (nenvs() > base)
+		sys_yield();
+	cprintf("exitbench: %s: %llu us\n", name, (time_ns() - start_ns) / 1000);
+}
+
+static void
+write_script(void)
+{
+	int fd, i;
+
+	if ((fd = open(SCRIPT, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", SCRIPT, fd);
+	for (i = 0; i < NCMD; i++)
+		fprintf(fd, "cat /motd > /exitbench.out\n");
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < sizeof(heap_pages) / sizeof(heap_pages[0]); i++)
+		exit_latency(heap_pages[i]);
+
+	run("forktree", "/bin/forktree", 0);
+	write_script();
+	run("sh script", "/bin/sh", SCRIPT);
+	cprintf("exitbench done\n");
+}
@@ -0,0 +1,55 @@
+// Measure fork cost as the parent's heap grows.  For each heap size,
+// map and dirty that many pages, then time NFORK forks (each child
+// exits at once) and the copy-on-write faults the parent takes when
+// it writes its whole heap again afterwards.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFORK	16
+#define HEAP	((char *) 0x10000000)
+
+static const int heap_pages[] = { 0, 256, 1024, 4096 };
+
+static void
+touch(int npages)
+{
+	int i;
+
+	for (i = 0; i < npages; i++)
+		HEAP[i * PGSIZE]++;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, p, r, mapped = 0;
+	uint64_t start, fork_cycles, fault_cycles;
+
+	for (p = 0; p < sizeof(heap_pages) / sizeof(heap_pages[0]); p++) {
+		for (; mapped < heap_pages[p]; mapped++)
+			if ((r = sys_page_alloc(0, HEAP + mapped * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+
+		fork_cycles = fault_cycles = 0;
+		for (i = 0; i < NFORK; i++) {
+			start = read_tsc();
+			if ((who = fork()) < 0)
+				panic("fork: %e", who);
+			if (who == 0)
+				exit();
+			fork_cycles += read_tsc() - start;
+			wait(who);
+
+			start = read_tsc();
+			touch(mapped);
+			fault_cycles += read_tsc() - start;
+		}
+		cprintf("forkbench: %4d heap pages: %llu cycles/fork, "
+			"%llu cycles/cow fault\n", mapped, fork_cycles / NFORK,
+			mapped ? fault_cycles / NFORK / mapped : 0);
+	}
+	cprintf("forkbench done\n");
+}
@@ -23,7 +23,7 @@ sum(const char *s, int n)
 void
 umain(int argc, char **argv)
 {
-	int i, r, x, want;
+	int i, r, x, want, status;
 	char args[256];
 
 	cprintf("init: running\n");
@@ -67,7 +67,10 @@ umain(int argc, char **argv)
 			continue;
 		}
 		cprintf("init waiting\n");
-		wait(r);
+		if ((r = sys_env_wait(r, &status)) < 0)
+			cprintf("init: wait for sh: %e\n", r);
+		else if (status != 0)
+			cprintf("init: sh exited with status %d\n", status);
 #line 72 "../user/init.c"
 #ifdef VMM_GUEST
 		break;
@@ -4,7 +4,7 @@
 void
 umain(int argc, char **argv)
 {
-	int i, r, x, want;
+	int i, r, x, want, status;
 
 	cprintf("initsh: running sh\n");
 
@@ -23,6 +23,9 @@ umain(int argc, char **argv)
 			cprintf("init: spawn sh: %e\n", r);
 			continue;
 		}
-		wait(r);
+		if ((r = sys_env_wait(r, &status)) < 0)
+			cprintf("init: wait for sh: %e\n", r);
+		else if (status != 0)
+			cprintf("init: sh exited with status %d\n", status);
 	}
 }
@@ -0,0 +1,95 @@
+// Measure IPC throughput with several clients running at once.  First
+// NCLIENT environments stream one-way messages to a receiver, as the
+// network server's input and output helpers do; with queued IPC the
+// sends complete without waiting for the receiver to be in ipc_recv.
+// Then NCLIENT environments read /motd through the file server
+// concurrently.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCLIENT	4
+#define NMSG	5000
+#define NREAD	500
+
+static envid_t
+fork_or_die(void)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	return who;
+}
+
+static void
+receive_all(void)
+{
+	int n;
+
+	for (n = 0; n < NCLIENT * NMSG; n++)
+		ipc_recv(0, 0, 0);
+}
+
+static void
+read_motd(void)
+{
+	char buf[512];
+	int fd, i, r;
+
+	if ((fd = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd: %e", fd);
+	for (i = 0; i < NREAD; i++) {
+		seek(fd, 0);
+		if ((r = read(fd, buf, sizeof(buf))) < 0)
+			panic("read /motd: %e", r);
+	}
+	close(fd);
+}
+
+static void
+report(const char *name, int nops, uint64_t cycles, uint64_t ns)
+{
+	cprintf("ipcqbench: %s: %llu cycles/op, %llu ops/sec\n", name,
+		cycles / nops, (uint64_t) nops * 1000000000 / (ns ? ns : 1));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t receiver, clients[NCLIENT];
+	uint64_t start, start_ns;
+	int i, j;
+
+	start_ns = time_ns();
+	start = read_tsc();
+	if ((receiver = fork_or_die()) == 0) {
+		receive_all();
+		return;
+	}
+	for (i = 0; i < NCLIENT; i++)
+		if ((clients[i] = fork_or_die()) == 0) {
+			for (j = 0; j < NMSG; j++)
+				ipc_send(receiver, j, 0, 0);
+			return;
+		}
+	for (i = 0; i < NCLIENT; i++)
+		sys_env_wait(clients[i], 0);
+	sys_env_wait(receiver, 0);
+	report("one-way sends", NCLIENT * NMSG, read_tsc() - start,
+	       time_ns() - start_ns);
+
+	start_ns = time_ns();
+	start = read_tsc();
+	for (i = 0; i < NCLIENT; i++)
+		if ((clients[i] = fork_or_die()) == 0) {
+			read_motd();
+			return;
+		}
+	for (i = 0; i < NCLIENT; i++)
+		sys_env_wait(clients[i], 0);
+	report("file reads", NCLIENT * NREAD, read_tsc() - start,
+	       time_ns() - start_ns);
+
+	cprintf("ipcqbench done\n");
+}
@@ -0,0 +1,67 @@
+// Measure IPC round-trip cost between two environments.  The parent
+// and a forked child bounce a counter NROUND times, first with
+// ipc_send and ipc_recv, then with ipc_call and ipc_reply_wait, so
+// every round trip switches address spaces twice.  With PCIDs, neither
+// side has to refill the TLB after a switch; with ipc_call, neither
+// switch goes through the scheduler.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	10000
+
+static void
+serve(void)
+{
+	envid_t who;
+	uint32_t i;
+
+	while ((i = ipc_recv(&who, 0, 0)) < NROUND)
+		ipc_send(who, i + 1, 0, 0);
+
+	i = ipc_reply_wait(0, 0, 0, 0, &who, 0, 0);
+	while (i < NROUND)
+		i = ipc_reply_wait(who, i + 1, 0, 0, &who, 0, 0);
+}
+
+static void
+report(const char *name, uint64_t cycles, uint64_t ns)
+{
+	cprintf("pingpongbench: %s: %llu cycles, %llu ns/round trip\n",
+		name, cycles / NROUND, ns / NROUND);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t i;
+	uint64_t start, start_ns, cycles;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		serve();
+		return;
+	}
+
+	start_ns = time_ns();
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		ipc_send(who, i, 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+	cycles = read_tsc() - start;
+	report("send/recv", cycles, time_ns() - start_ns);
+	ipc_send(who, NROUND, 0, 0);
+
+	start_ns = time_ns();
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++)
+		ipc_call(who, i, 0, 0, 0, 0);
+	cycles = read_tsc() - start;
+	report("call/reply", cycles, time_ns() - start_ns);
+	ipc_send(who, NROUND, 0, 0);
+
+	cprintf("pingpongbench done\n");
+}
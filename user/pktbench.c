@@ -0,0 +1,154 @@
+// Measure packets per second between the network server and its input
+// and output environments, first the way they used to move packets, a
+// freshly allocated page sent over IPC and unmapped by the receiver,
+// then through a channel ring like the one in net/.  Each direction
+// copies NPKT packets of PKTLEN bytes out of the producer and into a
+// consumer buffer, standing in for the NIC and lwIP, so only the cost
+// of the hop between environments differs.
+
+#include <inc/lib.h>
+#include <inc/ns.h>
+#include <inc/x86.h>
+
+#define NPKT		20000
+#define PKTLEN		1514
+#define NSLOTS		32
+#define SLOTSIZE	2048
+#define CHANVA		0x10000000
+#define PKTVA		0x10800000
+
+static struct Chan chan;
+static char buf[SLOTSIZE];
+
+static void
+produce(struct jif_pkt *pkt, int i)
+{
+	pkt->jp_len = PKTLEN;
+	memset(pkt->jp_data, i, PKTLEN);
+}
+
+static void
+consume(struct jif_pkt *pkt)
+{
+	memcpy(buf, pkt->jp_data, pkt->jp_len);
+}
+
+static void
+page_send(envid_t to, uint32_t req)
+{
+	struct jif_pkt *pkt = (struct jif_pkt *) PKTVA;
+	int i, r;
+
+	for (i = 0; i < NPKT; i++) {
+		if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		produce(pkt, i);
+		ipc_send(to, req, pkt, PTE_P|PTE_U);
+		sys_page_unmap(0, pkt);
+	}
+}
+
+static void
+page_recv(void)
+{
+	struct jif_pkt *pkt = (struct jif_pkt *) PKTVA;
+	int i;
+
+	for (i = 0; i < NPKT; i++) {
+		ipc_recv(0, pkt, 0);
+		consume(pkt);
+		sys_page_unmap(0, pkt);
+	}
+}
+
+static void
+chan_send(envid_t to, uint32_t req)
+{
+	struct jif_pkt *pkt;
+	int i;
+
+	chan_attach(&chan, to, req);
+	for (i = 0; i < NPKT; i++) {
+		while (!(pkt = chan_write_slot(&chan)))
+			sys_yield();
+		produce(pkt, i);
+		chan_write_commit(&chan);
+	}
+}
+
+static void
+chan_recv(void)
+{
+	struct jif_pkt *pkt;
+	int i = 0;
+
+	while (i < NPKT) {
+		chan_wait(&chan);
+		while ((pkt = chan_read_slot(&chan))) {
+			consume(pkt);
+			chan_read_done(&chan);
+			i++;
+		}
+	}
+}
+
+static void
+report(const char *name, uint64_t ns)
+{
+	cprintf("pktbench: %s: %llu packets/sec\n", name,
+		(uint64_t) NPKT * 1000000000 / (ns ? ns : 1));
+}
+
+// Run one direction: ns_input receives in the parent from a forked
+// producer, as the network server does; ns_output sends from the
+// parent to a forked consumer.
+static void
+run(const char *name, bool input, bool use_chan)
+{
+	envid_t parent = sys_getenvid(), who;
+	uint64_t start_ns;
+	int r;
+
+	if (use_chan && (r = chan_create(&chan, (void *) CHANVA,
+					 NSLOTS, SLOTSIZE)) < 0)
+		panic("chan_create: %e", r);
+
+	start_ns = time_ns();
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		if (input && use_chan)
+			chan_send(parent, NSREQ_INPUT);
+		else if (input)
+			page_send(parent, NSREQ_INPUT);
+		else if (use_chan)
+			chan_recv();
+		else
+			page_recv();
+		exit();
+	}
+	if (input && use_chan)
+		chan_recv();
+	else if (input)
+		page_recv();
+	else if (use_chan)
+		chan_send(who, NSREQ_OUTPUT);
+	else
+		page_send(who, NSREQ_OUTPUT);
+	sys_env_wait(who, 0);
+	report(name, time_ns() - start_ns);
+
+	if (use_chan)
+		for (r = 0; r < 1 + NSLOTS * SLOTSIZE / PGSIZE; r++)
+			sys_page_unmap(0, (char *) CHANVA + r * PGSIZE);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("ns_input, page ipc", 1, 0);
+	run("ns_input, channel", 1, 1);
+	run("ns_output, page ipc", 0, 0);
+	run("ns_output, channel", 0, 1);
+	cprintf("pktbench done\n");
+}
@@ -0,0 +1,100 @@
+// Measure the cost of N independent system calls made one trap at a
+// time against the same N calls submitted through the system call ring
+// and run on a single sys_ring_enter.  The first test makes the
+// cheapest call there is, so it shows the trap overhead alone; the
+// second allocates and unmaps N pages, as fork and spawn do.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define N	RING_NSQE
+#define NROUND	1000
+#define VA	((uintptr_t) 0x10000000)
+
+static void
+reap_all(int n)
+{
+	struct RingCqe cqe;
+	int r;
+
+	if ((r = ring_enter()) < 0)
+		panic("ring_enter: %e", r);
+	if (r < n)
+		panic("ring_enter: %d of %d calls completed", r, n);
+	while (ring_reap(&cqe))
+		if (cqe.cqe_res < 0)
+			panic("ring call %lld: %e", cqe.cqe_data,
+			      (int) cqe.cqe_res);
+}
+
+static void
+getenvid_direct(void)
+{
+	int i;
+
+	for (i = 0; i < N; i++)
+		sys_getenvid();
+}
+
+static void
+getenvid_ring(void)
+{
+	int i;
+
+	for (i = 0; i < N; i++)
+		ring_submit(i, SYS_getenvid, 0, 0, 0, 0, 0);
+	reap_all(N);
+}
+
+static void
+pages_direct(void)
+{
+	int i, r;
+
+	for (i = 0; i < N; i++)
+		if ((r = sys_page_alloc(0, (void *) (VA + i * PGSIZE),
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+	for (i = 0; i < N; i++)
+		sys_page_unmap(0, (void *) (VA + i * PGSIZE));
+}
+
+static void
+pages_ring(void)
+{
+	int i;
+
+	for (i = 0; i < N; i++)
+		ring_submit(i, SYS_page_alloc, 0, VA + i * PGSIZE,
+			    PTE_P|PTE_U|PTE_W, 0, 0);
+	reap_all(N);
+	for (i = 0; i < N; i++)
+		ring_submit(i, SYS_page_unmap, 0, VA + i * PGSIZE, 0, 0, 0);
+	reap_all(N);
+}
+
+static void
+measure(const char *name, void (*fn)(void), int ncalls)
+{
+	uint64_t start, start_ns, cycles, ns;
+	int i;
+
+	start_ns = time_ns();
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++)
+		fn();
+	cycles = read_tsc() - start;
+	ns = time_ns() - start_ns;
+	cprintf("ringbench: %s: %llu cycles, %llu ns per call\n", name,
+		cycles / (NROUND * ncalls), ns / (NROUND * ncalls));
+}
+
+void
+umain(int argc, char **argv)
+{
+	measure("getenvid, one trap each", getenvid_direct, N);
+	measure("getenvid, ring", getenvid_ring, N);
+	measure("page alloc+unmap, one trap each", pages_direct, 2 * N);
+	measure("page alloc+unmap, ring", pages_ring, 2 * N);
+	cprintf("ringbench done\n");
+}
@@ -0,0 +1,70 @@
+// Measure how system calls and page faults scale across CPUs.  For
+// 1, 2 and 4 workers, fork that many children; once all have started,
+// each makes NCALL sys_getenvid calls and then writes to every page of
+// a copy-on-write buffer, taking one page fault per page.  Run with
+// CPUS=1, 2 and 4: without a big kernel lock, throughput should grow
+// with the number of CPUs up to the number of workers.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALL	100000
+#define NPAGE	256
+#define BUF	((char *) 0x10000000)
+
+static volatile int *go = (volatile int *) 0x0ffff000;
+static const int nworkers[] = { 1, 2, 4 };
+
+static void
+worker(void)
+{
+	int i;
+
+	while (!*go)
+		sys_yield();
+	for (i = 0; i < NCALL; i++)
+		sys_getenvid();
+	for (i = 0; i < NPAGE; i++)
+		BUF[i * PGSIZE] = 1;	// copy-on-write fault
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, n, r;
+	envid_t who;
+	uint64_t start, cycles;
+
+	if ((r = sys_page_alloc(0, (void *) go,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	for (i = 0; i < NPAGE; i++)
+		if ((r = sys_page_alloc(0, BUF + i * PGSIZE,
+					PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+
+	for (n = 0; n < sizeof(nworkers) / sizeof(nworkers[0]); n++) {
+		*go = 0;
+		for (i = 0; i < nworkers[n]; i++) {
+			if ((who = fork()) < 0)
+				panic("fork: %e", who);
+			if (who == 0) {
+				worker();
+				return;
+			}
+		}
+
+		start = read_tsc();
+		*go = 1;
+		for (i = 0; i < nworkers[n]; i++)
+			ipc_recv(0, 0, 0);
+		cycles = read_tsc() - start;
+
+		cprintf("scalebench: %d workers: %llu cycles, "
+			"%llu ops/Mcycle\n", nworkers[n], cycles,
+			(uint64_t) nworkers[n] * (NCALL + NPAGE) * 1000000
+			/ cycles);
+	}
+	cprintf("scalebench done\n");
+}
@@ -0,0 +1,69 @@
+// Measure context-switch cost as the number of live environments grows.
+// For each population size, fork that many children that park in
+// ipc_recv (alive but never runnable), plus one child that spins in
+// sys_yield, and time NYIELD sys_yield calls in the parent with rdtsc.
+// With an O(1) scheduler the cycles per switch should stay flat.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NYIELD	2000
+
+static envid_t parked[NENV];
+static const int population[] = { 0, 16, 64, 256, 512 };
+
+static envid_t
+fork_or_die(void)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	return who;
+}
+
+static uint64_t
+time_yields(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+	return read_tsc() - start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spinner;
+	int i, p, nparked = 0;
+	uint64_t cycles;
+
+	if ((spinner = fork_or_die()) == 0)
+		while (1)
+			sys_yield();
+
+	for (p = 0; p < sizeof(population) / sizeof(population[0]); p++) {
+		for (; nparked < population[p]; nparked++) {
+			if ((parked[nparked] = fork_or_die()) == 0) {
+				ipc_recv(0, 0, 0);
+				exit();
+			}
+		}
+
+		// Let the new children reach ipc_recv before timing.
+		for (i = 0; i < 100; i++)
+			sys_yield();
+
+		cycles = time_yields();
+		cprintf("schedbench: %4d parked envs: %llu cycles/switch\n",
+			nparked, cycles / NYIELD);
+	}
+
+	for (i = 0; i < nparked; i++)
+		sys_env_destroy(parked[i]);
+	sys_env_destroy(spinner);
+	cprintf("schedbench done\n");
+}
@@ -28,9 +28,10 @@ void
 runcmd(char* s)
 {
 	char *argv[MAXARGS], *t, argv0buf[BUFSIZ];
-	int argc, c, i, r, p[2], fd, pipe_child;
+	int argc, c, i, r, p[2], fd, pipe_child, status;
 
 	pipe_child = 0;
+	status = 0;
 	gettoken(s, 0);
 
 again:
@@ -174,7 +175,7 @@ runit:
 	if (r >= 0) {
 		if (debug)
 			cprintf("[%08x] WAIT %s %08x\n", thisenv->env_id, argv[0], r);
-		wait(r);
+		sys_env_wait(r, &status);
 		if (debug)
 			cprintf("[%08x] wait finished\n", thisenv->env_id);
 	}
@@ -184,13 +185,13 @@ runit:
 	if (pipe_child) {
 		if (debug)
 			cprintf("[%08x] WAIT pipe_child %08x\n", thisenv->env_id, pipe_child);
-		wait(pipe_child);
+		sys_env_wait(pipe_child, 0);
 		if (debug)
 			cprintf("[%08x] wait finished\n", thisenv->env_id);
 	}
 
-	// Done!
-	exit();
+	// Done!  Exit with the spawned command's status.
+	exit_with(status);
 }
 
 
@@ -361,7 +362,7 @@ umain(int argc, char **argv)
 			runcmd(buf);
 			exit();
 		} else {
-			wait(r);
+			sys_env_wait(r, 0);
 #line 417 "../user/sh.c"
 			if (auto_terminate)
 				exit();
@@ -0,0 +1,32 @@
+// Measure the cost of spawn: cycles and system calls (traps) made by
+// the parent per spawnl of /bin/hello.  Most of the traps are the page
+// mapping calls for the child's segments, which sys_page_batch folds
+// into a few batches per segment.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NSPAWN	8
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint32_t calls = 0;
+	uint64_t cycles = 0, start;
+	uint32_t ncalls;
+	int i;
+
+	for (i = 0; i < NSPAWN; i++) {
+		ncalls = thisenv->env_syscalls;
+		start = read_tsc();
+		if ((who = spawnl("/bin/hello", "hello", 0)) < 0)
+			panic("spawnl: %e", who);
+		cycles += read_tsc() - start;
+		calls += thisenv->env_syscalls - ncalls;
+		wait(who);
+	}
+	cprintf("spawnbench: %llu cycles/spawn, %u syscalls/spawn\n",
+		cycles / NSPAWN, calls / NSPAWN);
+	cprintf("spawnbench done\n");
+}
@@ -4,8 +4,12 @@
 void
 umain(int argc, char **argv)
 {
-	int r;
+	int r, status;
 	cprintf("i am parent environment %08x\n", thisenv->env_id);
 	if ((r = spawnl("/bin/hello", "hello", 0)) < 0)
 		panic("spawn(hello) failed: %e", r);
+	if ((r = sys_env_wait(r, &status)) < 0)
+		panic("sys_env_wait(hello) failed: %e", r);
+	if (status != 0)
+		panic("hello exited with status %d", status);
 }
@@ -0,0 +1,55 @@
+// Measure system call latency on both kernel entry paths by timing
+// NCALL sys_getenvid calls with rdtsc: the old `int $T_SYSCALL' trap,
+// and the SYSCALL/SYSRET fast path that lib/syscall.c now uses.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALL	100000
+
+static envid_t
+getenvid_int(void)
+{
+	envid_t ret;
+
+	asm volatile("int %1"
+		     : "=a" (ret)
+		     : "i" (T_SYSCALL), "a" (SYS_getenvid)
+		     : "cc", "memory");
+	return ret;
+}
+
+static envid_t
+getenvid_syscall(void)
+{
+	envid_t ret;
+
+	asm volatile("syscall"
+		     : "=a" (ret)
+		     : "a" (SYS_getenvid)
+		     : "rcx", "r11", "cc", "memory");
+	return ret;
+}
+
+static uint64_t
+time_calls(envid_t (*call)(void))
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		if (call() != thisenv->env_id)
+			panic("getenvid returned the wrong id");
+	return (read_tsc() - start) / NCALL;
+}
+
+void
+umain(int argc, char **argv)
+{
+	cprintf("syscallbench: int:     %llu cycles/call\n",
+		time_calls(getenvid_int));
+	cprintf("syscallbench: syscall: %llu cycles/call\n",
+		time_calls(getenvid_syscall));
+	cprintf("syscallbench done\n");
+}
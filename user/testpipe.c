@@ -7,7 +7,7 @@ void
 umain(int argc, char **argv)
 {
 	char buf[100];
-	int i, pid, p[2];
+	int i, j, pid, p[2];
 
 	binaryname = "pipereadeof";
 
@@ -61,5 +61,22 @@ umain(int argc, char **argv)
 	close(p[1]);
 	wait(pid);
 
+	// A read asking for more than the pipe holds returns what is there,
+	// and leaves the pipe in a state where later reads still work.
+	binaryname = "pipeshortread";
+	if ((i = pipe(p)) < 0)
+		panic("pipe: %e", i);
+	for (j = 0; j < 2; j++) {
+		if ((i = write(p[1], msg, 10)) != 10)
+			panic("write: %e", i);
+		if ((i = read(p[0], buf, sizeof buf)) != 10)
+			panic("short read returned %d, not 10", i);
+		if (memcmp(buf, msg, 10) != 0)
+			panic("short read got the wrong bytes");
+	}
+	close(p[0]);
+	close(p[1]);
+	cprintf("pipe short read ok\n");
+
 	cprintf("pipe tests passed\n");
 }
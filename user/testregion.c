@@ -0,0 +1,73 @@
+// Check demand-zero regions from sys_region_reserve: untouched pages
+// cost nothing, the first touch reads as zeros, system calls can use
+// untouched pages, fork children inherit the region (and system calls
+// can write its copy-on-write pages), and releasing it unmaps
+// everything.
+
+#include <inc/lib.h>
+
+#define REGION	((char *) 0xA0000000)
+#define LEN	(64 * 1024 * 1024)
+
+static bool
+mapped(char *va)
+{
+	return (uvpde[VPDPE(va)] & PTE_P) && (uvpd[VPD(va)] & PTE_P)
+		&& (uvpt[PGNUM(va)] & PTE_P);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct PageOp *ops;
+	envid_t kid;
+	int r, status;
+
+	if ((r = sys_region_reserve(REGION, LEN, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_region_reserve: %e", r);
+	if (sys_region_reserve(REGION + LEN - PGSIZE, PGSIZE,
+			       PTE_P|PTE_U|PTE_W) != -E_INVAL)
+		panic("overlapping region was reserved");
+	if (mapped(REGION))
+		panic("region was mapped up front");
+
+	if (REGION[LEN / 2] != 0)
+		panic("first touch is not zero");
+	REGION[LEN / 2] = 'x';
+	if (!mapped(REGION + LEN / 2) || mapped(REGION + LEN / 2 + PGSIZE))
+		panic("touch mapped the wrong pages");
+
+	// The kernel fills in untouched pages that a system call writes.
+	// An all-zero PageOp is an invalid PAGEOP_ALLOC.
+	ops = (struct PageOp *) (REGION + LEN - PGSIZE);
+	if ((r = sys_page_batch(ops, 1)) != 0 || ops->status != -E_INVAL)
+		panic("sys_page_batch on untouched page: %d, %d", r, ops->status);
+
+	ops->status = 1;
+	if ((kid = fork()) < 0)
+		panic("fork: %e", kid);
+	if (kid == 0) {
+		if (REGION[LEN / 2] != 'x' || REGION[PGSIZE] != 0)
+			panic("child sees the wrong contents");
+		// ops is copy-on-write now; the kernel copies it to write
+		// the status, rather than failing the system call.
+		if ((r = sys_page_batch(ops, 1)) != 0 || ops->status != -E_INVAL)
+			panic("sys_page_batch on copy-on-write page: %d, %d",
+			      r, ops->status);
+		exit();
+	}
+	if ((r = sys_env_wait(kid, &status)) < 0 || status != 0)
+		panic("child failed: %e, status %d", r, status);
+	if (ops->status != 1)
+		panic("child's write reached the parent's page");
+
+	sys_page_unmap(0, REGION + LEN / 2);
+	if (REGION[LEN / 2] != 0)
+		panic("unmapped page did not read as zero again");
+
+	if ((r = sys_region_reserve(REGION, LEN, 0)) < 0)
+		panic("releasing region: %e", r);
+	if (mapped(REGION + LEN / 2))
+		panic("release left pages mapped");
+	cprintf("testregion OK\n");
+}
@@ -34,7 +34,7 @@ umain(int argc, char **argv)
 			panic("spawn: %e", r);
 		close(0);
 		close(1);
-		wait(r);
+		sys_env_wait(r, 0);
 		exit();
 	}
 	close(rfd);
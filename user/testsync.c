@@ -0,0 +1,64 @@
+// Check the futex-based mutex, condition variable and semaphore in
+// lib/sync.c across environments sharing a PTE_SHARE page.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NITER	1000
+
+struct Shared {
+	struct Mutex mu;
+	struct Cond cv;
+	struct Sem sem;
+	int counter;
+	int ready;
+};
+
+static struct Shared *sh = (struct Shared *) 0xA0000000;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD];
+	int i, j, r;
+
+	if ((r = sys_page_alloc(0, sh, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	mutex_init(&sh->mu);
+	cond_init(&sh->cv);
+	sem_init(&sh->sem, 0);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			// Wait for the go signal, then bump the counter.
+			mutex_lock(&sh->mu);
+			while (!sh->ready)
+				cond_wait(&sh->cv, &sh->mu);
+			mutex_unlock(&sh->mu);
+			for (j = 0; j < NITER; j++) {
+				mutex_lock(&sh->mu);
+				sh->counter++;
+				mutex_unlock(&sh->mu);
+			}
+			sem_post(&sh->sem);
+			exit();
+		}
+	}
+
+	mutex_lock(&sh->mu);
+	sh->ready = 1;
+	cond_broadcast(&sh->cv);
+	mutex_unlock(&sh->mu);
+
+	for (i = 0; i < NCHILD; i++)
+		sem_wait(&sh->sem);
+	if (sh->counter != NCHILD * NITER)
+		panic("counter is %d, not %d", sh->counter, NCHILD * NITER);
+	if (sem_timedwait(&sh->sem, 20) != -E_TIMEOUT)
+		panic("sem_timedwait did not time out");
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+	cprintf("testsync OK\n");
+}
@@ -0,0 +1,76 @@
+// Measure TLB reach: touch random pages of a REGION-sized buffer,
+// first backed by 4K pages and then by 2MB (PTE_PS) pages, and report
+// the average cost of one access.  With 4K pages nearly every access
+// misses the TLB; with 2MB pages the whole buffer fits in it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define REGION	(64 << 20)
+#define NACCESS	(1 << 20)
+#define BUF	((char *) 0x10000000)
+
+static struct PageBatch batch;
+
+static void
+map_region(size_t step, int perm)
+{
+	size_t off;
+	int r;
+
+	for (off = 0; off < REGION; off += step)
+		if ((r = pagebatch_add(&batch, PAGEOP_ALLOC, 0, 0,
+				       0, BUF + off, perm)) < 0)
+			panic("map %p: %e", BUF + off, r);
+	if ((r = pagebatch_flush(&batch)) < 0)
+		panic("map: %e", r);
+}
+
+static void
+unmap_region(size_t step)
+{
+	size_t off;
+	int r;
+
+	for (off = 0; off < REGION; off += step)
+		if ((r = pagebatch_add(&batch, PAGEOP_UNMAP, 0, 0,
+				       0, BUF + off, 0)) < 0)
+			panic("unmap %p: %e", BUF + off, r);
+	if ((r = pagebatch_flush(&batch)) < 0)
+		panic("unmap: %e", r);
+}
+
+static uint64_t
+time_accesses(void)
+{
+	uint64_t start, x = 1;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NACCESS; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		BUF[(x >> 24) % (REGION / PGSIZE) * PGSIZE]++;
+	}
+	return read_tsc() - start;
+}
+
+static void
+run(const char *name, size_t step, int perm)
+{
+	uint64_t cycles;
+
+	map_region(step, perm);
+	time_accesses();	// warm up the caches
+	cycles = time_accesses();
+	unmap_region(step);
+	cprintf("tlbbench: %s pages: %llu cycles/access\n",
+		name, cycles / NACCESS);
+}
+
+void
+umain(int argc, char **argv)
+{
+	run("4K", PGSIZE, PTE_P|PTE_U|PTE_W);
+	run("2MB", PTSIZE, PTE_P|PTE_U|PTE_W|PTE_PS);
+	cprintf("tlbbench done\n");
+}
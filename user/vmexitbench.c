@@ -0,0 +1,32 @@
+// Measure VM-exit throughput from inside a guest.  Every cpuid
+// instruction in the guest traps to the host VMM, so counting how many
+// complete per second of guest time gives exits/sec.  Compare the
+// number with and without the VMRESUME fast path in the host.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS		5
+#define ROUND_MSEC	1000
+#define BATCH		1024
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t exits;
+	int r, i, end;
+
+	for (r = 0; r < NROUNDS; r++) {
+		exits = 0;
+		end = sys_time_msec() + ROUND_MSEC;
+		while (sys_time_msec() < end) {
+			for (i = 0; i < BATCH; i++)
+				cpuid(0, &eax, &ebx, &ecx, &edx);
+			exits += BATCH;
+		}
+		cprintf("vmexitbench: round %d: %llu exits/sec\n",
+			r, exits * 1000 / ROUND_MSEC);
+	}
+	cprintf("vmexitbench done\n");
+}
@@ -9,6 +9,12 @@
 
 #define JOS_ENTRY 0x7000
 
+// Number of pages map_in_guest stages at UTEMP per round trip;
+// each needs an EPT map and an unmap entry in one batch.
+#define GUEST_STAGE (PAGEOP_MAX / 2)
+
+static struct PageBatch batch;
+
 // Map a region of file fd into the guest at guest physical address gpa.
 // The file region to map should start at fileoffset and be length filesz.
 // The region to map in the guest should be memsz.  The region can span multiple pages.
@@ -20,53 +26,47 @@ static int
 map_in_guest( envid_t guest, uintptr_t gpa, size_t memsz, 
 	      int fd, size_t filesz, off_t fileoffset ) {
     
-	int r;
-    void *srcva;
-    size_t i;
-    uintptr_t gpa_start = (uintptr_t)gpa;
+	int r, k, n;
+    size_t i, size_to_read;
 
     //seek once to get to the fileoffset, or return if error.
     if((r = seek(fd, fileoffset)) < 0) {
         return r;
     }
     
-    // Iterate over each page in the segment
-    for (i = 0; i < memsz; i += PGSIZE) {
-        // Use UTEMP for temporary page mapping
-        srcva = UTEMP;
-        if ((r = sys_page_alloc(0, srcva, PTE_P | PTE_U | PTE_W)) < 0) {
-            cprintf("1");
-            return r; 
-        }
+    // Stage up to GUEST_STAGE pages at a time at UTEMP: one batch
+    // allocates them, then after reading the file into them a second
+    // batch moves them all into the guest with PAGEOP_EPT_MAP.
+    for (i = 0; i < memsz; i += n * PGSIZE) {
+        n = MIN(GUEST_STAGE, (ROUNDUP(memsz, PGSIZE) - i) / PGSIZE);
+        for (k = 0; k < n; k++)
+            pagebatch_add(&batch, PAGEOP_ALLOC, 0, 0,
+                          0, UTEMP + k * PGSIZE, PTE_P | PTE_U | PTE_W);
+        if ((r = pagebatch_flush(&batch)) < 0)
+            return r;
 
-        size_t bytes_remaining_file = 0;
-        if (i < filesz) {
-            bytes_remaining_file = filesz - i;
-        }
-        
-        size_t size_to_read = (bytes_remaining_file < PGSIZE) ? bytes_remaining_file : PGSIZE;
-        
-        // Read data from file if needed
+        // Read data from file if needed; the pages start out zeroed.
+        size_to_read = i < filesz ? MIN(n * PGSIZE, filesz - i) : 0;
         if (size_to_read > 0) {
-            if ((r = readn(fd, srcva, size_to_read)) != size_to_read) {
-                sys_page_unmap(0, srcva);
+            if ((r = readn(fd, UTEMP, size_to_read)) != size_to_read) {
+                for (k = 0; k < n; k++)
+                    sys_page_unmap(0, UTEMP + k * PGSIZE);
                 return -E_INVAL;
             }
         }
-        
-        // Zero the rest of the page if needed
-        if (size_to_read < PGSIZE) {
-            memset((char*)srcva + size_to_read, 0, PGSIZE - size_to_read);
-        }
 
-        // Map the page into the guest's physical memory using sys_ept_map
-       
-        if ((r = sys_ept_map(sys_getenvid(), srcva, guest, (void *)(gpa_start + i), __EPTE_FULL)) < 0) {
-            sys_page_unmap(0, srcva);
+        // Map the pages into the guest's physical memory and drop ours.
+        for (k = 0; k < n; k++) {
+            pagebatch_add(&batch, PAGEOP_EPT_MAP, 0, UTEMP + k * PGSIZE,
+                          guest, (void *)(gpa + i + k * PGSIZE), __EPTE_FULL);
+            pagebatch_add(&batch, PAGEOP_UNMAP, 0, 0,
+                          0, UTEMP + k * PGSIZE, 0);
+        }
+        if ((r = pagebatch_flush(&batch)) < 0) {
+            for (k = 0; k < n; k++)
+                sys_page_unmap(0, UTEMP + k * PGSIZE);
             return r;
         }
-        
-        sys_page_unmap(0, srcva);
     }
 
     return 0; // Success
@@ -207,7 +207,7 @@ umain(int argc, char **argv) {
 #endif
 	// Mark the guest as runnable.
 	sys_env_set_status(guest, ENV_RUNNABLE);
-	wait(guest);
+	sys_env_wait(guest, 0);
 }
 
 
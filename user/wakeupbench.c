@@ -0,0 +1,54 @@
+// Measure how long a blocked environment takes to run again after
+// another environment wakes it with ipc_send.  The parent and a forked
+// child take turns: each stamps the TSC into a shared page, wakes the
+// other and blocks in ipc_recv.  Run with CPUS=2 or more, so the woken
+// side's CPU is halted: without a reschedule IPI it only notices the
+// wakeup at its next timer interrupt.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	1000
+
+static volatile uint64_t *stamp = (volatile uint64_t *) 0x0ffff000;
+
+// Wake 'who', then wait to be woken and return how long that took.
+static uint64_t
+wake_and_wait(envid_t who)
+{
+	*stamp = read_tsc();
+	ipc_send(who, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+	return read_tsc() - *stamp;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t lat, total = 0, max = 0;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) stamp,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		ipc_recv(0, 0, 0);
+		for (i = 0; i < NROUND; i++)
+			wake_and_wait(thisenv->env_parent_id);
+		return;
+	}
+
+	for (i = 0; i < NROUND; i++) {
+		lat = wake_and_wait(who);
+		total += lat;
+		max = MAX(max, lat);
+	}
+	ipc_send(who, 0, 0, 0);
+
+	cprintf("wakeupbench: %llu cycles/wakeup on average, %llu max\n",
+		total / NROUND, max);
+	cprintf("wakeupbench done\n");
+}
@@ -220,6 +220,8 @@ handle_cpuid(struct Trapframe *tf, struct VmxGuestInfo *ginfo)
 
 	if(in == 1) {
 		ecx &= ~(1 << 5);
+		// Hide PCIDs; the guest's VMCS doesn't enable INVPCID.
+		ecx &= ~(1 << 17);
 	}
 
 	tf->tf_regs.reg_rax = (uint64_t)eax;
@@ -350,7 +352,7 @@ handle_vmcall(struct Trapframe *tf, struct VmxGuestInfo *gInfo, uint64_t *eptrt)
 		break;
 	case VMX_VMCALL_BACKTOHOST:
 		cprintf("Now back to the host, VM halt in the background, run vmmanager to resume the VM.\n");
-		curenv->env_status = ENV_NOT_RUNNABLE;	//mark the guest not runable
+		env_set_status(curenv, ENV_NOT_RUNNABLE);	//mark the guest not runable
 		ENV_CREATE(user_sh, ENV_TYPE_USER);	//create a new host shell
 		handled = true;
 		break;	
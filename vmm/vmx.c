@@ -42,7 +42,7 @@ bool vmx_sel_resume(int num) {
 			vm_count++;
 			if (vm_count == num) {
 				cprintf("Resume vm.%d\n", num);
-				envs[i].env_status = ENV_RUNNABLE;
+				env_set_status(&envs[i], ENV_RUNNABLE);
 				return true;
 			}
 		}
@@ -421,7 +421,10 @@ void vmcs_dump_cpu() {
 
 }
 
-void vmexit() {
+// Returns true if the guest can be re-entered straight away with
+// VMRESUME; otherwise gives the CPU back to the scheduler and does
+// not return.
+bool vmexit() {
 	int exit_reason = -1;
 	bool exit_handled = false;
 	static uint32_t host_vector;
@@ -472,20 +475,30 @@ void vmexit() {
 		env_destroy(curenv);
 	}
 
+	// Fast path: the current VMCS is still loaded on this CPU, so skip
+	// the scheduler unless the time slice ended (an external interrupt
+	// exit) or the guest blocked, exited or is being torn down.
+	if (exit_handled
+	    && (exit_reason & EXIT_REASON_MASK) != EXIT_REASON_EXTERNAL_INT
+	    && curenv && curenv->env_type == ENV_TYPE_GUEST
+	    && curenv->env_status == ENV_RUNNING)
+		return true;
+
 	sched_yield();
 }
 
 // CHANGED FOR LAB 0
-void asm_vmrun(struct Trapframe *tf) {
+bool asm_vmrun(struct Trapframe *tf) {
 
 	/* cprintf("VMRUN\n"); */
 	// NOTE: Since we re-use Trapframe structure, tf.tf_err contains the value
 	// of cr2 of the guest.
 
 	// Hint, Lab 0: tf_ds should have the number of runs, prior to entering the assembly!!
-	tf->tf_ds = curenv->env_runs;
+	// tf_ds is only 16 bits wide; clamp so a large run count never
+	// looks like a first launch.
+	tf->tf_ds = MIN(curenv->env_runs, 0xffff);
 	tf->tf_es = 0;
-	unlock_kernel();
 	asm volatile (
 		"push %%rdx; push %%rbp;"
 		"push %%rcx \n\t" /* placeholder for guest rcx */
@@ -612,14 +625,13 @@ void asm_vmrun(struct Trapframe *tf) {
 		  , "rax", "rbx", "rdi", "rsi"
 		  , "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
 		);
-	lock_kernel();
 	if(tf->tf_es) {
 		cprintf("Error during VMLAUNCH/VMRESUME\n");
-	} else {
-		curenv->env_tf.tf_rsp = vmcs_read64(VMCS_GUEST_RSP);
-		curenv->env_tf.tf_rip = vmcs_read64(VMCS_GUEST_RIP);
-		vmexit();
+		return false;
 	}
+	curenv->env_tf.tf_rsp = vmcs_read64(VMCS_GUEST_RSP);
+	curenv->env_tf.tf_rip = vmcs_read64(VMCS_GUEST_RIP);
+	return vmexit();
 }
 
 void
@@ -701,9 +713,14 @@ int vmx_vmrun( struct Env *e ) {
 		}
 	}
 	
-	vmcs_write64( VMCS_GUEST_RSP, curenv->env_tf.tf_rsp  );
-	vmcs_write64( VMCS_GUEST_RIP, curenv->env_tf.tf_rip );
-    //panic("asm_vmrun is incomplete");
-	asm_vmrun( &e->env_tf );
+	// Stay in this loop for as long as exits are handled without
+	// blocking; each extra pass counts as a run and uses VMRESUME.
+	for (;;) {
+		vmcs_write64( VMCS_GUEST_RSP, curenv->env_tf.tf_rsp  );
+		vmcs_write64( VMCS_GUEST_RIP, curenv->env_tf.tf_rip );
+		if (!asm_vmrun( &e->env_tf ))
+			break;
+		e->env_runs++;
+	}
 	return 0;
 }